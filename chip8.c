@@ -1,54 +1,218 @@
+#include <pthread.h>
+
 #include "chip8_private.h"
 #include "chip8_naive.h"
 #include "chip8_ci.h"
 #include "chip8_dyn.h"
+#include "chip8_tier.h"
 
-chip8_t *c8_new(void)
+#define C8_CACHE_LINE 64
+#define C8_RNG_SEED   0x2545f491 /* used for the seed 0, which xorshift can't take */
+
+static const uint8_t c8_font[] = {
+    0xf0, 0x90, 0x90, 0x90, 0xf0,
+    0x20, 0x60, 0x20, 0x20, 0x70,
+    0xf0, 0x10, 0xf0, 0x80, 0xf0,
+    0xf0, 0x10, 0xf0, 0x10, 0xf0,
+    0x90, 0x90, 0xf0, 0x10, 0x10,
+    0xf0, 0x80, 0xf0, 0x10, 0xf0,
+    0xf0, 0x80, 0xf0, 0x90, 0xf0,
+    0xf0, 0x10, 0x20, 0x40, 0x40,
+    0xf0, 0x90, 0xf0, 0x90, 0xf0,
+    0xf0, 0x90, 0xf0, 0x10, 0xf0,
+    0xf0, 0x90, 0xf0, 0x90, 0x90,
+    0xe0, 0x90, 0xe0, 0x90, 0xe0,
+    0xf0, 0x80, 0x80, 0x80, 0xf0,
+    0xe0, 0x90, 0x90, 0x90, 0xe0,
+    0xf0, 0x80, 0xf0, 0x80, 0xf0,
+    0xf0, 0x80, 0xf0, 0x80, 0x80,
+};
+
+/*
+ * An instance and its memories in a single allocation, the registers and the
+ * stack first since they are touched by every instruction. Only the
+ * translation caches live elsewhere, clones share them.
+ */
+typedef struct c8_block c8_block_t;
+struct c8_block {
+    chip8_t       c8;
+    uint16_t      stack[CHIP8_STACK_SIZE];
+    chip8_pool_t *pool;
+    c8_block_t   *next; /* next free block of the pool */
+
+    chip8_row_t   vram[CHIP8_VIDEO_ROWS] __attribute__((aligned(C8_CACHE_LINE)));
+    uint8_t       ram[CHIP8_RAM_SIZE] __attribute__((aligned(C8_CACHE_LINE)));
+};
+
+struct chip8_pool {
+    pthread_mutex_t lock;
+    c8_block_t     *free;
+};
+
+/* a free block of the pool if there is one, a new one without caches otherwise */
+static c8_block_t *c8_block_get(chip8_pool_t *pool)
 {
-    static uint8_t font[] = {
-        0xf0, 0x90, 0x90, 0x90, 0xf0,
-        0x20, 0x60, 0x20, 0x20, 0x70,
-        0xf0, 0x10, 0xf0, 0x80, 0xf0,
-        0xf0, 0x10, 0xf0, 0x10, 0xf0,
-        0x90, 0x90, 0xf0, 0x10, 0x10,
-        0xf0, 0x80, 0xf0, 0x10, 0xf0,
-        0xf0, 0x80, 0xf0, 0x90, 0xf0,
-        0xf0, 0x10, 0x20, 0x40, 0x40,
-        0xf0, 0x90, 0xf0, 0x90, 0xf0,
-        0xf0, 0x90, 0xf0, 0x10, 0xf0,
-        0xf0, 0x90, 0xf0, 0x90, 0x90,
-        0xe0, 0x90, 0xe0, 0x90, 0xe0,
-        0xf0, 0x80, 0x80, 0x80, 0xf0,
-        0xe0, 0x90, 0x90, 0x90, 0xe0,
-        0xf0, 0x80, 0xf0, 0x80, 0xf0,
-        0xf0, 0x80, 0xf0, 0x80, 0x80,
-    };
-
-    chip8_t *c8 = (chip8_t*)calloc(1, sizeof(chip8_t));
-    c8->ram   = (uint8_t*)calloc(1,  CHIP8_RAM_SIZE);
-    c8->vram  = (uint8_t*)calloc(1,  CHIP8_VIDEO_ROWS * CHIP8_VIDEO_COLS);
-    c8->stack = (uint16_t*)calloc(1, CHIP8_STACK_SIZE * sizeof(uint16_t));
+    c8_block_t *block = NULL;
+
+    if (pool)
+    {
+        pthread_mutex_lock(&pool->lock);
+        block = pool->free;
+        if (block)
+            pool->free = block->next;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (!block)
+    {
+        if (posix_memalign((void**)&block, C8_CACHE_LINE, sizeof(c8_block_t)))
+        {
+            fprintf(stderr, "chip8: out of memory\n");
+            exit(1);
+        }
+
+        memset(block, 0, sizeof(c8_block_t));
+        block->pool = pool;
+    }
+
+    return block;
+}
+
+static chip8_t *c8_create(chip8_pool_t *pool)
+{
+    c8_block_t *block = c8_block_get(pool);
+    chip8_t    *c8    = &block->c8;
+    void       *ci    = c8->ci;
+    void       *dyn   = c8->dyn;
+
+    memset(c8, 0, sizeof(chip8_t));
+    memset(block->stack, 0, sizeof(block->stack));
+    memset(block->vram, 0, sizeof(block->vram));
+    memset(block->ram, 0, sizeof(block->ram));
+
+    c8->ram   = block->ram;
+    c8->vram  = block->vram;
+    c8->stack = block->stack;
     c8->pc    = 512;
+    c8->backend = CHIP8_BACKEND_DYN;
+    c8->damage  = ~0u;
+    c8->next_tick = CHIP8_TICK;
+    c8->idle_miss = 0xffff;
+    c8->rng       = C8_RNG_SEED;
+
+    memcpy(&c8->ram[CHIP8_FONT_ADDR], c8_font, sizeof(c8_font));
 
-    memcpy(&c8->ram[CHIP8_FONT_ADDR], font, sizeof(font));
+    // recycled blocks keep their emptied caches
+    c8->ci  = ci;
+    c8->dyn = dyn;
 
-    c8_ci_new(c8);
-    c8_dyn_new(c8);
+    if (!c8->ci)
+        c8_ci_new(c8);
+
+    if (!c8->dyn)
+        c8_dyn_new(c8);
 
     return c8;
 }
 
+chip8_t *c8_new(void)
+{
+    return c8_create(NULL);
+}
+
+/* instances from a pool go back to it */
 void c8_free(chip8_t *c8)
 {
-    free(c8->ram);
-    free(c8->vram);
-    free(c8->stack);
+    c8_block_t   *block = (c8_block_t*)c8;
+    chip8_pool_t *pool  = block->pool;
+
+    if (pool)
+    {
+        c8_ci_reset(c8);
+        c8_dyn_recycle(c8);
+
+        pthread_mutex_lock(&pool->lock);
+        block->next = pool->free;
+        pool->free  = block;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
 
     c8_ci_free(c8);
     c8_dyn_free(c8);
 
-    memset(c8, 0, sizeof(*c8));
-    free(c8);
+    free(block);
+}
+
+/*
+ * Recycles freed instances, translation caches included, which makes creating
+ * one much cheaper than c8_new. Safe to use from several threads.
+ */
+chip8_pool_t *c8_pool_new(void)
+{
+    chip8_pool_t *pool = (chip8_pool_t*)calloc(1, sizeof(chip8_pool_t));
+
+    if (!pool)
+    {
+        fprintf(stderr, "chip8: out of memory\n");
+        exit(1);
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/* every instance taken from the pool must have been freed already */
+void c8_pool_free(chip8_pool_t *pool)
+{
+    while (pool->free)
+    {
+        c8_block_t *block = pool->free;
+
+        pool->free = block->next;
+        c8_ci_free(&block->c8);
+        c8_dyn_free(&block->c8);
+        free(block);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* a new instance in the same state as c8_new would give */
+chip8_t *c8_pool_get(chip8_pool_t *pool)
+{
+    return c8_create(pool);
+}
+
+/*
+ * Returns a copy of the instance, queued key events included. Both share the
+ * translations made so far until either writes over them. Must not be called
+ * while the instance is running. Clones of pooled instances come from the
+ * same pool.
+ */
+chip8_t *c8_clone(chip8_t *c8)
+{
+    c8_block_t *block = c8_block_get(((c8_block_t*)c8)->pool);
+    chip8_t    *clone = &block->c8;
+    void       *ci    = clone->ci;
+    void       *dyn   = clone->dyn;
+
+    *clone = *c8;
+    memcpy(block->stack, c8->stack, sizeof(block->stack));
+    memcpy(block->vram, c8->vram, sizeof(block->vram));
+    memcpy(block->ram, c8->ram, sizeof(block->ram));
+
+    clone->ram   = block->ram;
+    clone->vram  = block->vram;
+    clone->stack = block->stack;
+    clone->ci    = ci;
+    clone->dyn   = dyn;
+
+    c8_ci_clone(clone, c8);
+    c8_dyn_clone(clone, c8);
+
+    return clone;
 }
 
 void c8_load(chip8_t *c8, uint8_t *data, size_t size)
@@ -56,43 +220,442 @@ void c8_load(chip8_t *c8, uint8_t *data, size_t size)
     c8->state = 0;
     c8->pc    = 0x200;
 
-    memset(c8->vram, 0, CHIP8_VIDEO_ROWS * CHIP8_VIDEO_COLS);
+    c8_clear(c8);
+    c8->damage = ~0u;
 
-    if (size > (CHIP8_STACK_SIZE-512))
-        size = CHIP8_STACK_SIZE-512;
+    if (size > CHIP8_RAM_SIZE - 512)
+        size = CHIP8_RAM_SIZE - 512;
 
     memcpy(c8->ram+512, data, size);
-    c8ci_invalidate(c8, 0, 4096);
+    c8_ci_reset(c8);
+    c8_dyn_reset(c8);
 }
 
+// little endian, whatever the host is
+static uint8_t *c8_put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    return p + 2;
+}
 
-void c8_set_poll(chip8_t *c8, chip8_poll_t poll, uintptr_t data)
+static uint8_t *c8_put32(uint8_t *p, uint32_t val)
 {
-    c8->poll      = poll;
-    c8->poll_data = data;
+    return c8_put16(c8_put16(p, val), val >> 16);
 }
 
+static uint8_t *c8_put64(uint8_t *p, uint64_t val)
+{
+    return c8_put32(c8_put32(p, val), val >> 32);
+}
 
-void c8_run(chip8_t *c8, unsigned cycles)
+static const uint8_t *c8_get16(const uint8_t *p, uint16_t *val)
 {
+    *val = p[0] | p[1] << 8;
+    return p + 2;
+}
+
+static const uint8_t *c8_get32(const uint8_t *p, uint32_t *val)
+{
+    uint16_t lo, hi;
+
+    p    = c8_get16(c8_get16(p, &lo), &hi);
+    *val = lo | (uint32_t)hi << 16;
+    return p;
+}
+
+static const uint8_t *c8_get64(const uint8_t *p, uint64_t *val)
+{
+    uint32_t lo, hi;
+
+    p    = c8_get32(c8_get32(p, &lo), &hi);
+    *val = lo | (uint64_t)hi << 32;
+    return p;
+}
+
+static const uint8_t c8_save_magic[4] = { 'C', '8', 'S', 'T' };
+
+#define C8_SAVE_SIZE (sizeof(c8_save_magic) + 2 +                  \
+                      2 + 2 + 16 + 1 + 1 +                         \
+                      1 + CHIP8_STACK_SIZE * 2 +                   \
+                      CHIP8_RAM_SIZE + CHIP8_VIDEO_ROWS * 8 + 16 + \
+                      4 + 4 + 4 + 4 + 4 + 4 +                      \
+                      1 + 1 + CHIP8_KEY_QUEUE)
+
+/*
+ * Writes the machine state to buf and returns its size, or 0 if size is too
+ * small. Returns the size needed if buf is NULL. Translations are not saved.
+ */
+size_t c8_save_state(const chip8_t *c8, uint8_t *buf, size_t size)
+{
+    uint8_t *p = buf;
+
+    if (!buf)
+        return C8_SAVE_SIZE;
+
+    if (size < C8_SAVE_SIZE)
+        return 0;
+
+    memcpy(p, c8_save_magic, sizeof(c8_save_magic));
+    p = c8_put16(p + sizeof(c8_save_magic), CHIP8_SAVE_VERSION);
+
+    p = c8_put16(p, c8->pc);
+    p = c8_put16(p, c8->i);
+    memcpy(p, c8->v, 16);
+    p += 16;
+    *p++ = c8->dt;
+    *p++ = c8->st;
+
+    *p++ = c8->stack_ptr;
+    for (unsigned n = 0; n < CHIP8_STACK_SIZE; ++n)
+        p = c8_put16(p, c8->stack[n]);
+
+    memcpy(p, c8->ram, CHIP8_RAM_SIZE);
+    p += CHIP8_RAM_SIZE;
+    for (unsigned row = 0; row < CHIP8_VIDEO_ROWS; ++row)
+        p = c8_put64(p, c8->vram[row]);
+    memcpy(p, c8->kbd, 16);
+    p += 16;
+
+    p = c8_put32(p, c8->state);
+    p = c8_put32(p, c8->run_time);
+    p = c8_put32(p, c8->next_tick);
+    p = c8_put32(p, c8->next_input);
+    p = c8_put32(p, c8->input_interval);
+    p = c8_put32(p, c8->rng);
+
+    *p++ = c8->keyq_head;
+    *p++ = c8->keyq_tail;
+    memcpy(p, c8->keyq, CHIP8_KEY_QUEUE);
+    p += CHIP8_KEY_QUEUE;
+
+    return p - buf;
+}
+
+/* copies ram, dropping the translations of the bytes that change */
+static void c8_restore_ram(chip8_t *c8, const uint8_t *ram)
+{
+    unsigned addr = 0;
+
+    while (addr < CHIP8_RAM_SIZE)
+    {
+        unsigned begin, same = 0;
+
+        if (c8->ram[addr] == ram[addr])
+        {
+            ++addr;
+            continue;
+        }
+
+        // changes a few bytes apart are invalidated together
+        for (begin = addr; addr < CHIP8_RAM_SIZE && same < 16; ++addr)
+            same = c8->ram[addr] == ram[addr] ? same + 1 : 0;
+
+        memcpy(&c8->ram[begin], &ram[begin], addr - begin);
+
+        if (c8_code_hit(c8, begin, addr - begin))
+        {
+            c8ci_invalidate(c8, begin, addr);
+            c8dyn_invalidate(c8, begin, addr - 1);
+        }
+    }
+
+    c8dyn_reap((c8dyn_t*)c8->dyn);
+}
+
+/*
+ * Restores a state written by c8_save_state, possibly by another instance.
+ * Only the translations of the ram that differs are dropped. Returns false,
+ * leaving the instance alone, if buf does not hold a state of this version.
+ */
+bool c8_load_state(chip8_t *c8, const uint8_t *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    uint16_t       version, pc, i, stack[CHIP8_STACK_SIZE];
+    uint32_t       rng;
+    uint8_t        keyq_head, keyq_tail;
+
+    if (size < C8_SAVE_SIZE || memcmp(p, c8_save_magic, sizeof(c8_save_magic)))
+        return false;
+
+    p = c8_get16(p + sizeof(c8_save_magic), &version);
+    if (version != CHIP8_SAVE_VERSION)
+        return false;
+
+    // the fields that could break the machine are checked before anything changes
+    if (p[2 + 2 + 16 + 1 + 1] > CHIP8_STACK_SIZE)
+        return false;
+
+    keyq_head = buf[C8_SAVE_SIZE - CHIP8_KEY_QUEUE - 2];
+    keyq_tail = buf[C8_SAVE_SIZE - CHIP8_KEY_QUEUE - 1];
+    if ((uint8_t)(keyq_tail - keyq_head) > CHIP8_KEY_QUEUE)
+        return false;
+
+    // xorshift never leaves 0
+    c8_get32(&buf[C8_SAVE_SIZE - CHIP8_KEY_QUEUE - 2 - 4], &rng);
+    if (!rng)
+        return false;
+
+    p = c8_get16(p, &pc);
+    p = c8_get16(p, &i);
+    c8->pc = pc;
+    c8->i  = i;
+    memcpy(c8->v, p, 16);
+    p += 16;
+    c8->dt = *p++;
+    c8->st = *p++;
+
+    c8->stack_ptr = *p++;
+    for (unsigned n = 0; n < CHIP8_STACK_SIZE; ++n)
+        p = c8_get16(p, &stack[n]);
+    memcpy(c8->stack, stack, sizeof(stack));
+
+    c8_restore_ram(c8, p);
+    p += CHIP8_RAM_SIZE;
+
+    for (unsigned row = 0; row < CHIP8_VIDEO_ROWS; ++row)
+    {
+        chip8_row_t pixels;
+
+        p = c8_get64(p, &pixels);
+        if (pixels != c8->vram[row])
+            c8->damage |= 1u << row;
+        c8->vram[row] = pixels;
+    }
+
+    for (unsigned key = 0; key < 16; ++key)
+        c8->kbd[key] = *p++ != 0;
+
+    p = c8_get32(p, &c8->state);
+    p = c8_get32(p, &c8->run_time);
+    p = c8_get32(p, &c8->next_tick);
+    p = c8_get32(p, &c8->next_input);
+    p = c8_get32(p, &c8->input_interval);
+    p = c8_get32(p, &c8->rng);
+
+    c8->keyq_head = *p++;
+    c8->keyq_tail = *p++;
+    memcpy(c8->keyq, p, CHIP8_KEY_QUEUE);
+
+    c8->cycles    = 0;
+    c8->idle_miss = 0xffff;
+
+    return true;
+}
+
+/*
+ * Queues a key press or release. Events are applied at the next timer tick or
+ * c8_run, when a key is tested or waited for, and every input interval.
+ * Returns false if the key is invalid or the queue is full. Must not be called
+ * while the instance is running.
+ */
+bool c8_key_event(chip8_t *c8, uint8_t key, bool pressed)
+{
+    if (key > 0xf || (uint8_t)(c8->keyq_tail - c8->keyq_head) == CHIP8_KEY_QUEUE)
+        return false;
+
+    c8->keyq[c8->keyq_tail++ % CHIP8_KEY_QUEUE] = key | (pressed ? CHIP8_KEY_DOWN : 0);
+    return true;
+}
+
+/* seeds the generator behind rnd vx, byte, instances given the same seed run alike */
+void c8_seed(chip8_t *c8, uint32_t seed)
+{
+    c8->rng = seed ? seed : C8_RNG_SEED;
+}
+
+/* also applies queued key events every given number of cycles, 0 turns it off */
+void c8_set_input_interval(chip8_t *c8, unsigned cycles)
+{
+    c8->input_interval = cycles;
+    c8->next_input     = c8->run_time + cycles;
+}
+
+bool c8_pixel(const chip8_t *c8, unsigned x, unsigned y)
+{
+    if (x >= CHIP8_VIDEO_COLS || y >= CHIP8_VIDEO_ROWS)
+        return false;
+
+    return (c8->vram[y] >> (CHIP8_VIDEO_COLS - 1 - x)) & 1;
+}
+
+/* unpacks the display into a byte per pixel, row by row */
+void c8_get_pixels(const chip8_t *c8, uint8_t pixels[CHIP8_VIDEO_ROWS * CHIP8_VIDEO_COLS])
+{
+    for (unsigned y = 0; y < CHIP8_VIDEO_ROWS; ++y)
+    {
+        for (unsigned x = 0; x < CHIP8_VIDEO_COLS; ++x)
+            pixels[y * CHIP8_VIDEO_COLS + x] = (c8->vram[y] >> (CHIP8_VIDEO_COLS - 1 - x)) & 1;
+    }
+}
+
+/* returns the rows changed since the last call, the caller is expected to redraw them */
+uint32_t c8_take_damage(chip8_t *c8)
+{
+    uint32_t damage = c8->damage;
+
+    c8->damage = 0;
+    return damage;
+}
+
+/*
+ * Takes effect on the next c8_run. Translations are dropped since the other
+ * backends don't keep them up to date with writes to ram.
+ */
+void c8_set_backend(chip8_t *c8, unsigned backend)
+{
+    if (backend > CHIP8_BACKEND_TIERED || backend == c8->backend)
+        return;
+
+    if (backend == CHIP8_BACKEND_CI || backend == CHIP8_BACKEND_TIERED)
+        c8_ci_reset(c8);
+    if (backend == CHIP8_BACKEND_DYN || backend == CHIP8_BACKEND_TIERED)
+        c8_dyn_reset(c8);
+
+    c8->backend = backend;
+}
+
+/*
+ * Has the tiered backend hand hot code to a compiler thread shared by all
+ * instances and interpret it until the translation is ready, so a frame never
+ * waits for sljit. When translations land depends on that thread, runs stop
+ * being reproducible cycle for cycle.
+ */
+void c8_set_background_compile(chip8_t *c8, bool enable)
+{
+    c8->background_compile = enable;
+}
+
+/*
+ * Caps the executable memory holding the translations of the instance, in
+ * whole 64 KB regions and at least one. Once it is used up the translations
+ * entered least recently are dropped. 0 goes back to the default of 512 KB.
+ * Must not be called while the instance is running.
+ */
+void c8_set_code_budget(chip8_t *c8, size_t bytes)
+{
+    c8_dyn_set_budget(c8, bytes);
+}
+
+/* the counters keep going across c8_load and c8_clone, a clone starts its own */
+void c8_code_stats(const chip8_t *c8, chip8_code_stats_t *stats)
+{
+    c8_dyn_stats(c8, stats);
+}
+
+/* cycles until dt and st have both run out, 0 if they have */
+unsigned c8_timer_cycles(const chip8_t *c8)
+{
+    const unsigned ticks = c8->dt > c8->st ? c8->dt : c8->st;
+
+    if (!ticks)
+        return 0;
+
+    return c8->next_tick - c8->run_time + (ticks - 1) * CHIP8_TICK;
+}
+
+/* CHIP8_RUN_HALT or CHIP8_RUN_KEY if running on would only count down the timers */
+static unsigned c8_stopped(const chip8_t *c8)
+{
+    const uint16_t pc    = c8->pc & 0xfff;
+    const uint16_t instr = c8->ram[pc] << 8 | c8->ram[(pc + 1) & 0xfff];
+
+    // the jp has run once if c8_jump flagged it
+    if (instr == (0x1000 | pc) && (c8->state & CHIP8_STATE_HALT) && (pc >= 0x200 || (c8->state & CHIP8_STATE_ILEGAL)))
+        return CHIP8_RUN_HALT;
+
+    // and fx0a if c8_wait_key stored 255
+    if ((instr & 0xf0ff) == 0xf00a && c8->v[(instr >> 8) & 0xf] == 255 && c8->keyq_head == c8->keyq_tail)
+    {
+        for (unsigned key = 0; key < 16; ++key)
+        {
+            if (c8->kbd[key])
+                return CHIP8_RUN_CYCLES;
+        }
+
+        return CHIP8_RUN_KEY;
+    }
+
+    return CHIP8_RUN_CYCLES;
+}
+
+/* moves a stopped instance on to end at once, only the timers and the key queue move */
+static void c8_sleep(chip8_t *c8, unsigned end)
+{
+    unsigned ticks = 0, syncs;
+
+    if ((int)(end - c8->next_tick) >= 0)
+        ticks = (end - c8->next_tick) / CHIP8_TICK + 1;
+
+    c8->dt         = c8->dt > ticks ? c8->dt - ticks : 0;
+    c8->st         = c8->st > ticks ? c8->st - ticks : 0;
+    c8->next_tick += ticks * CHIP8_TICK;
+    syncs          = ticks;
+
+    if (c8->input_interval && (int)(end - c8->next_input) >= 0)
+    {
+        const unsigned n = (end - c8->next_input) / c8->input_interval + 1;
+
+        c8->next_input += n * c8->input_interval;
+        syncs          += n;
+    }
+
+    while (syncs-- && c8->keyq_head != c8->keyq_tail)
+        c8_input_sync(c8);
+
+    c8->run_time = end;
+}
+
+/*
+ * Backends run with cycles set to the distance to the nearest deadline and
+ * stop right at it, none of them runs an instruction past a timer tick. They
+ * know nothing about timers or input, the events are handled here between
+ * the slices, which keeps every backend on the same state at any run_time.
+ * Returns one of CHIP8_RUN_*, a stopped instance is moved to the end of the
+ * run without executing anything.
+ */
+unsigned c8_run(chip8_t *c8, unsigned cycles)
+{
+    unsigned end, stop;
+
     if (cycles == 0)
-        cycles = CHIP8_CLOCK / 60;
+        cycles = CHIP8_TICK;
 
-    c8->cycles = cycles;
+    end = c8->run_time + cycles;
+    c8_input_sync(c8);
 
-    switch (2)
+    while (!c8_reached(c8, end))
     {
-    case 0:
-        while (c8->cycles)
-            c8_naive_step(c8);
-        break;
-    case 1:
-        while (c8->cycles)
-            c8_ci_step(c8);
-        break;
-    case 2:
-        while (c8->cycles)
-            c8_dyn_step(c8);
-        break;
+        if ((stop = c8_stopped(c8)) != CHIP8_RUN_CYCLES)
+        {
+            c8_sleep(c8, end);
+            return stop;
+        }
+
+        c8->cycles = c8_sched_budget(c8, end);
+
+        switch (c8->backend)
+        {
+        case CHIP8_BACKEND_NAIVE:
+            while (c8->cycles)
+                c8_naive_step(c8);
+            break;
+        case CHIP8_BACKEND_CI:
+            while (c8->cycles)
+                c8_ci_step(c8);
+            break;
+        case CHIP8_BACKEND_DYN:
+            while (c8->cycles)
+                c8_dyn_step(c8);
+            break;
+        case CHIP8_BACKEND_TIERED:
+            while (c8->cycles)
+                c8_tier_step(c8);
+            break;
+        }
+
+        c8_sched_events(c8);
     }
+
+    return c8_stopped(c8);
 }
@@ -3,13 +3,20 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define CHIP8_RAM_SIZE   4096
 #define CHIP8_STACK_SIZE 12
 #define CHIP8_VIDEO_ROWS 32
 #define CHIP8_VIDEO_COLS 64
 #define CHIP8_CLOCK      1760000
+#define CHIP8_TICK       (CHIP8_CLOCK/60) /* cycles between timer decrements */
 #define CHIP8_FONT_ADDR  (0x200-(5*16))
+#define CHIP8_KEY_QUEUE  32 /* pending key events per instance, a power of two */
+#define CHIP8_SAVE_VERSION 2 /* bumped whenever the c8_save_state layout changes */
+
+/* a display row, the most significant bit is the leftmost pixel */
+typedef uint64_t chip8_row_t;
 
 enum {
     CHIP8_STATE_STACK   = 1, /* stack overflow or underflow */
@@ -18,7 +25,25 @@ enum {
     CHIP8_STATE_HALT    = 8
 };
 
-typedef void (*chip8_poll_t)(uint8_t kbd[16], uintptr_t data);
+/*
+ * Why c8_run returned. An instance stopped on a jp to itself or on fx0a with
+ * no key down only counts down its timers from then on, so a scheduler can
+ * park it until c8_key_event (for a key wait) or c8_timer_cycles pass. Calling
+ * c8_run for the time it was parked catches up in constant time, do it before
+ * queueing the key that wakes it.
+ */
+enum {
+    CHIP8_RUN_CYCLES, /* ran all the cycles */
+    CHIP8_RUN_HALT,   /* stuck in a jp to itself */
+    CHIP8_RUN_KEY     /* waiting for a key press */
+};
+
+enum {
+    CHIP8_BACKEND_NAIVE, /* plain interpreter */
+    CHIP8_BACKEND_CI,    /* cached interpreter */
+    CHIP8_BACKEND_DYN,   /* dynamic recompiler */
+    CHIP8_BACKEND_TIERED /* cached interpreter, recompiling the code that runs often */
+};
 
 typedef struct
 {
@@ -29,8 +54,9 @@ typedef struct
     uint8_t v[16];
     uint8_t dt, st;
 
-    uint8_t  *ram;
-    uint8_t  *vram;
+    uint8_t     *ram;
+    chip8_row_t *vram;   /* CHIP8_VIDEO_ROWS rows */
+    uint32_t     damage; /* rows changed since the last c8_take_damage, bit n is row n */
 
     uint8_t   stack_ptr;
     uint16_t *stack;
@@ -38,22 +64,66 @@ typedef struct
     void     *dyn;
     void     *ci;
 
+    /* bit n is set while a translation depends on ram byte n, see c8_code_hit */
+    uint32_t  code[CHIP8_RAM_SIZE / 32 + 1]; /* the last word is padding */
+
     uint8_t kbd[16];
 
-    chip8_poll_t poll;
-    uintptr_t    poll_data;
+    /* key events not applied to kbd yet, see c8_key_event */
+    uint8_t  keyq[CHIP8_KEY_QUEUE];
+    uint8_t  keyq_head, keyq_tail;
+    unsigned input_interval;
 
+    /* deadlines, as run_time values */
+    unsigned next_tick;
+    unsigned next_input;
+
+    uint16_t idle_miss; /* last loop found not to be idle since the last deadline */
+
+    uint32_t rng; /* xorshift state for rnd, see c8_seed */
+
+    unsigned backend;
+    bool     background_compile; /* see c8_set_background_compile */
     unsigned state;
     unsigned cycles;
     unsigned run_time;
 
 } chip8_t;
 
+/* translation cache usage of an instance, see c8_code_stats */
+typedef struct
+{
+    size_t   code_bytes;     /* executable memory held, translations shared by clones not included */
+    unsigned blocks;         /* translations resident */
+    unsigned translations;   /* made since the instance was created */
+    unsigned retranslations; /* of those, for addresses translated before */
+    unsigned evictions;      /* translations dropped to stay within the code budget */
+} chip8_code_stats_t;
+
+/* recycles freed instances, see c8_pool_new */
+typedef struct chip8_pool chip8_pool_t;
+
 chip8_t *c8_new(void);
 void     c8_free(chip8_t *c8);
+chip8_t *c8_clone(chip8_t *c8);
+chip8_pool_t *c8_pool_new(void);
+void          c8_pool_free(chip8_pool_t *pool);
+chip8_t      *c8_pool_get(chip8_pool_t *pool);
 void     c8_load(chip8_t *c8, uint8_t *data, size_t size);
-void     c8_set_poll(chip8_t *c8, chip8_poll_t poll, uintptr_t data);
-void     c8_run(chip8_t *c8, unsigned cycles);
+bool     c8_key_event(chip8_t *c8, uint8_t key, bool pressed);
+void     c8_set_input_interval(chip8_t *c8, unsigned cycles);
+void     c8_seed(chip8_t *c8, uint32_t seed);
+void     c8_set_backend(chip8_t *c8, unsigned backend);
+void     c8_set_background_compile(chip8_t *c8, bool enable);
+void     c8_set_code_budget(chip8_t *c8, size_t bytes);
+void     c8_code_stats(const chip8_t *c8, chip8_code_stats_t *stats);
+bool     c8_pixel(const chip8_t *c8, unsigned x, unsigned y);
+void     c8_get_pixels(const chip8_t *c8, uint8_t pixels[CHIP8_VIDEO_ROWS * CHIP8_VIDEO_COLS]);
+uint32_t c8_take_damage(chip8_t *c8);
+unsigned c8_timer_cycles(const chip8_t *c8);
+size_t   c8_save_state(const chip8_t *c8, uint8_t *buf, size_t size);
+bool     c8_load_state(chip8_t *c8, const uint8_t *buf, size_t size);
+unsigned c8_run(chip8_t *c8, unsigned cycles);
 
 #endif // CHIP8_H
 
@@ -1,26 +1,107 @@
 #include "chip8_private.h"
 #include <stddef.h>
 
-#define C8CI_OP_ARGS uintptr_t d, uintptr_t a, uintptr_t b
+/*
+ * Register operands are byte offsets into chip8_t rather than pointers, so a
+ * translation does not depend on the instance it was made for. Clones share
+ * the cache until one of them changes it, which copies it first.
+ */
+#define C8CI_OP_ARGS uint16_t d, uint16_t a, uint16_t b
 typedef void (*c8ci_op_t)(chip8_t *c8, C8CI_OP_ARGS);
 typedef struct {
     c8ci_op_t op;
-    uintptr_t d;
-    uintptr_t a, b;
+    uint16_t d;
+    uint16_t a, b;
 } c8ci_tac_t;
 
-static c8ci_tac_t c8ci_cache[4096];
+typedef struct {
+    c8ci_tac_t cache[4096];
+    unsigned   refs; /* instances sharing the cache */
+} c8ci_t;
+
+#define C8CI_OFF(field) ((uint16_t)offsetof(chip8_t, field))
+#define C8CI_V(x)       ((uint16_t)(offsetof(chip8_t, v) + (x)))
+#define C8CI_U8(off)    (*((uint8_t*)c8 + (off)))
+#define C8CI_U16(off)   (*(uint16_t*)((uint8_t*)c8 + (off)))
+
+/*
+ * Instructions looked at after an arithmetic op to find out whether its vf
+ * result is ever read. Translations dropping the flag depend on the code that
+ * far ahead, C8CI_REACH bytes from their own, so invalidation reaches back as
+ * much.
+ */
+#define C8CI_VF_WINDOW 8
+#define C8CI_REACH     (2 + C8CI_VF_WINDOW * 2)
 
 #define c8ci_def_begin(name) static void c8ci_##name(chip8_t *c8, C8CI_OP_ARGS) { c8->pc += 2;
 #define c8ci_def_end(name) }
 
 
 static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS);
+static void c8_tier_invalidate(chip8_t *c8, uint16_t begin, uint16_t end);
+
+static void c8ci_release(c8ci_t *ci)
+{
+    if (__atomic_sub_fetch(&ci->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(ci);
+}
+
+/* the cache of c8, copied first if it is shared */
+static c8ci_t *c8ci_own(chip8_t *c8)
+{
+    c8ci_t *ci = (c8ci_t*)c8->ci;
+
+    if (__atomic_load_n(&ci->refs, __ATOMIC_ACQUIRE) > 1)
+    {
+        c8ci_t *copy = (c8ci_t*)malloc(sizeof(c8ci_t));
+
+        if (!copy)
+        {
+            fprintf(stderr, "ci: out of memory\n");
+            exit(1);
+        }
+
+        memcpy(copy, ci, sizeof(c8ci_t));
+        copy->refs = 1;
+
+        c8ci_release(ci);
+        c8->ci = ci = copy;
+    }
+
+    return ci;
+}
+
 static void c8ci_invalidate(chip8_t *c8, uint16_t begin, uint16_t end)
 {
+    const c8ci_t *ci = (c8ci_t*)c8->ci;
+
+    // ranges based on i wrap around the end of ram
+    end    = (begin & 0xfff) + (uint16_t)(end - begin);
+    begin &= 0xfff;
+
+    if (end > 4096)
+    {
+        c8ci_invalidate(c8, 0, end & 0xfff);
+        end = 4096;
+    }
+
+    // nothing depends on the range anymore once this returns
+    c8_code_clear(c8, begin, end - begin);
+
+    begin = begin > C8CI_REACH - 1 ? begin - (C8CI_REACH - 1) : 0;
+
+    // untranslated ranges don't need a copy of a shared cache
+    while (begin < end && ci->cache[begin].op == c8ci_translate)
+        ++begin;
+
+    if (begin == end)
+        return;
+
+    c8ci_t *own = c8ci_own(c8);
+
     for (uint16_t i = begin; i < end; ++i)
     {
-        (&c8ci_cache[i])->op = c8ci_translate;
+        own->cache[i].op = c8ci_translate;
     }
 }
 
@@ -29,7 +110,7 @@ c8ci_def_begin(illegal)
 c8ci_def_end()
 
 c8ci_def_begin(cls)
-    memset(c8->vram, 0, CHIP8_VIDEO_ROWS * CHIP8_VIDEO_COLS);
+    c8_clear(c8);
 c8ci_def_end()
 
 c8ci_def_begin(pop)
@@ -40,8 +121,13 @@ c8ci_def_begin(jp)
     c8_jump(c8, a);
 c8ci_def_end()
 
+c8ci_def_begin(jp_idle)
+    c8_jump(c8, a);
+    c8_idle_skip(c8, 1);
+c8ci_def_end()
+
 c8ci_def_begin(jp_nnn)
-    c8_jump(c8, *(uint8_t*)a + b);
+    c8_jump(c8, C8CI_U8(a) + b);
 c8ci_def_end()
 
 c8ci_def_begin(call)
@@ -50,52 +136,63 @@ c8ci_def_begin(call)
 c8ci_def_end()
 
 c8ci_def_begin(se_kk)
-    if (*(uint8_t*)a == b)
+    if (C8CI_U8(a) == b)
         c8->pc += 2;
 c8ci_def_end()
 
 c8ci_def_begin(sne_kk)
-    if (*(uint8_t*)a != b)
+    if (C8CI_U8(a) != b)
         c8->pc += 2;
 c8ci_def_end()
 
 c8ci_def_begin(se)
-    uint8_t *vx = (uint8_t*)a;
-    uint8_t *vy = (uint8_t*)b;
-    if (*vx == *vy)
+    if (C8CI_U8(a) == C8CI_U8(b))
         c8->pc += 2;
 c8ci_def_end()
 
 c8ci_def_begin(sne)
-    uint8_t *vx = (uint8_t*)a;
-    uint8_t *vy = (uint8_t*)b;
-    if (*vx != *vy)
+    if (C8CI_U8(a) != C8CI_U8(b))
         c8->pc += 2;
 c8ci_def_end()
 
 c8ci_def_begin(ld_kk)
-    if ((uintptr_t)&c8->i == d)
-        *(uint16_t*)d = a;
+    if (d == C8CI_OFF(i))
+        C8CI_U16(d) = a;
     else
-        *(uint8_t*)d = a;
+        C8CI_U8(d) = a;
 c8ci_def_end()
 
 c8ci_def_begin(ld)
-    *(uint8_t*)d = *(uint8_t*)a;
+    C8CI_U8(d) = C8CI_U8(a);
 c8ci_def_end()
 
 c8ci_def_begin(ld_f)
-    *(uint16_t*)d = CHIP8_FONT_ADDR + *(uint8_t*)a * 5;
+    C8CI_U16(d) = CHIP8_FONT_ADDR + C8CI_U8(a) * 5;
 c8ci_def_end()
 
+/* stores only invalidate what they overwrite of the code */
+static inline void c8ci_store(chip8_t *c8, uint16_t addr, unsigned len)
+{
+    if (!c8_code_hit(c8, addr, len))
+        return;
+
+    // tiered instances may have a dyn block over it as well
+    if (c8->backend == CHIP8_BACKEND_TIERED)
+        c8_tier_invalidate(c8, addr, addr + len);
+    else
+        c8ci_invalidate(c8, addr, addr + len);
+}
+
 c8ci_def_begin(ld_bcd)
-    c8_load_bcd(c8, a);
-    c8ci_invalidate(c8, c8->i, c8->i+2);
+    c8_load_bcd(c8, C8CI_U8(a));
+    c8ci_store(c8, c8->i, 3);
 c8ci_def_end()
 
 c8ci_def_begin(ld_r2m)
+    const uint16_t addr = c8->i;
+
     c8_load_ram(c8, false, a);
-    c8ci_invalidate(c8, c8->i, a+1);
+    c8ci_store(c8, addr, a + 1);
 c8ci_def_end()
 
 c8ci_def_begin(ld_m2r)
@@ -103,77 +200,106 @@ c8ci_def_begin(ld_m2r)
 c8ci_def_end()
 
 c8ci_def_begin(add_kk)
-    *(uint8_t*)d = *(uint8_t*)a + b;
+    C8CI_U8(d) = C8CI_U8(a) + b;
 c8ci_def_end()
 
 c8ci_def_begin(or)
-    *(uint8_t*)d = *(uint8_t*)a | *(uint8_t*)b;
+    C8CI_U8(d) = C8CI_U8(a) | C8CI_U8(b);
 c8ci_def_end()
 
 c8ci_def_begin(and)
-    *(uint8_t*)d = *(uint8_t*)a & *(uint8_t*)b;
+    C8CI_U8(d) = C8CI_U8(a) & C8CI_U8(b);
 c8ci_def_end()
 
 c8ci_def_begin(xor)
-    *(uint8_t*)d = *(uint8_t*)a ^ *(uint8_t*)b;
+    C8CI_U8(d) = C8CI_U8(a) ^ C8CI_U8(b);
 c8ci_def_end()
 
 c8ci_def_begin(add)
-    if ((uintptr_t)&c8->i == a)
-        *(uint16_t*)d = *(uint16_t*)a + *(uint8_t*)b;
+    if (a == C8CI_OFF(i))
+        C8CI_U16(d) = C8CI_U16(a) + C8CI_U8(b);
     else
     {
-        c8->v[15] = ((uint32_t)*(uint8_t*)a + (uint32_t)*(uint8_t*)b) > 0xff;
-        *(uint8_t*)d = *(uint8_t*)a + *(uint8_t*)b;
+        c8->v[15] = ((uint32_t)C8CI_U8(a) + (uint32_t)C8CI_U8(b)) > 0xff;
+        C8CI_U8(d) = C8CI_U8(a) + C8CI_U8(b);
     }
 c8ci_def_end()
 
+c8ci_def_begin(add_nf)
+    C8CI_U8(d) = C8CI_U8(a) + C8CI_U8(b);
+c8ci_def_end()
+
 c8ci_def_begin(sub)
-    c8->v[15] = *(uint8_t*)a > *(uint8_t*)a;
-    *(uint8_t*)d = *(uint8_t*)a - *(uint8_t*)b;
+    c8->v[15] = C8CI_U8(a) >= C8CI_U8(b);
+    C8CI_U8(d) = C8CI_U8(a) - C8CI_U8(b);
+c8ci_def_end()
+
+c8ci_def_begin(subn)
+    c8->v[15] = C8CI_U8(a) > C8CI_U8(b);
+    C8CI_U8(d) = C8CI_U8(a) - C8CI_U8(b);
+c8ci_def_end()
+
+c8ci_def_begin(sub_nf)
+    C8CI_U8(d) = C8CI_U8(a) - C8CI_U8(b);
 c8ci_def_end()
 
 c8ci_def_begin(shr)
-    c8->v[15] = *(uint8_t*)a & 1;
-    *(uint8_t*)d = *(uint8_t*)a >> 1;
+    c8->v[15] = C8CI_U8(a) & 1;
+    C8CI_U8(d) = C8CI_U8(a) >> 1;
+c8ci_def_end()
+
+c8ci_def_begin(shr_nf)
+    C8CI_U8(d) = C8CI_U8(a) >> 1;
 c8ci_def_end()
 
 c8ci_def_begin(shl)
-    c8->v[15] = *(uint8_t*)a >> 7;
-    *(uint8_t*)d = *(uint8_t*)a << 1;
+    c8->v[15] = C8CI_U8(a) >> 7;
+    C8CI_U8(d) = C8CI_U8(a) << 1;
+c8ci_def_end()
+
+c8ci_def_begin(shl_nf)
+    C8CI_U8(d) = C8CI_U8(a) << 1;
 c8ci_def_end()
 
 c8ci_def_begin(rnd)
-    *(uint8_t*)d = rand() & a;
+    C8CI_U8(d) = c8_rand(c8) & a;
 c8ci_def_end()
 
 c8ci_def_begin(drw)
-    c8_draw(c8, *(uint8_t*)d, *(uint8_t*)a, b);
+    c8_draw(c8, C8CI_U8(d), C8CI_U8(a), b);
 c8ci_def_end()
 
 c8ci_def_begin(skp)
-    c8->pc += c8->kbd[*(uint8_t*)a] * 2;
+    c8->pc += c8->kbd[C8CI_U8(a) & 0xf] * 2;
+    c8_input_sync(c8);
 c8ci_def_end()
 
 c8ci_def_begin(sknp)
-    c8->pc += (!c8->kbd[*(uint8_t*)a]) * 2;
+    c8->pc += (!c8->kbd[C8CI_U8(a) & 0xf]) * 2;
+    c8_input_sync(c8);
 c8ci_def_end()
 
 c8ci_def_begin(ld_key)
-    *(uint8_t*)d = c8_wait_key(c8);
+    C8CI_U8(d) = c8_wait_key(c8);
+
+    if (C8CI_U8(d) == 255)
+        c8_idle_skip(c8, 1);
 c8ci_def_end()
 
 static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS)
 {
-    c8ci_tac_t *tac      = &c8ci_cache[c8->pc];
-    const uint16_t instr = c8->ram[c8->pc] << 8 | c8->ram[c8->pc + 1];
+    c8ci_tac_t *tac      = &c8ci_own(c8)->cache[c8->pc];
+    const uint16_t instr = c8->ram[c8->pc] << 8 | c8->ram[(c8->pc + 1) & 0xfff];
     const uint8_t x    = (instr >> 8) & 0x0f;
     const uint8_t y    = (instr >> 4) & 0xf;
     const uint8_t kk   = instr & 0x00ff;
     const uint16_t nnn = instr & 0x0fff;
 
-    uint8_t *vx = &c8->v[x];
-    uint8_t *vy = &c8->v[y];
+    const uint16_t vx = C8CI_V(x);
+    const uint16_t vy = C8CI_V(y);
+
+    // the flag of 8xyN can be dropped if nothing reads it, unless it is also an operand
+    const bool vf_dead = x != CHIP8_VF && y != CHIP8_VF && c8_vf_dead(c8->ram, c8->pc + 2, C8CI_VF_WINDOW);
 
     tac->op = c8ci_illegal;
     tac->d  = tac->a = tac->b = 0;
@@ -196,7 +322,7 @@ static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS)
         }
         break;
     case 0x1: // jp nnn
-        tac->op = c8ci_jp;
+        tac->op = c8_idle_candidate(c8->ram, nnn, c8->pc) ? c8ci_jp_idle : c8ci_jp;
         tac->a  = nnn;
         break;
     case 0x2: // call nnn
@@ -205,28 +331,28 @@ static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS)
         break;
     case 0x3: // se vx, kk
         tac->op = c8ci_se_kk;
-        tac->a  = (uintptr_t)vx;
+        tac->a  = vx;
         tac->b  = kk;
         break;
     case 0x4: // sne vx, kk
         tac->op = c8ci_sne_kk;
-        tac->a  = (uintptr_t)vx;
+        tac->a  = vx;
         tac->b  = kk;
         break;
     case 0x5: // se vx, vy
         tac->op = c8ci_se;
-        tac->a  = (uintptr_t)vx;
-        tac->b  = (uintptr_t)vy;
+        tac->a  = vx;
+        tac->b  = vy;
         break;
     case 0x6: // ld vx, kk
         tac->op = c8ci_ld_kk;
-        tac->d  = (uintptr_t)vx;
+        tac->d  = vx;
         tac->a  = kk;
         break;
     case 0x7: // add vx, kk
         tac->op = c8ci_add_kk;
-        tac->d  = (uintptr_t)vx;
-        tac->a  = (uintptr_t)vx;
+        tac->d  = vx;
+        tac->a  = vx;
         tac->b  = kk;
         break;
     case 0x8: // op vx, vy
@@ -235,84 +361,84 @@ static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS)
         {
         case 0x0: // ld
             tac->op = c8ci_ld;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vy;
+            tac->d  = vx;
+            tac->a  = vy;
             break;
         case 0x1: // or
             tac->op = c8ci_or;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
-            tac->b  = (uintptr_t)vy;
+            tac->d  = vx;
+            tac->a  = vx;
+            tac->b  = vy;
             break;
         case 0x2: // and
             tac->op = c8ci_and;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
-            tac->b  = (uintptr_t)vy;
+            tac->d  = vx;
+            tac->a  = vx;
+            tac->b  = vy;
             break;
         case 0x3: // xor
             tac->op = c8ci_xor;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
-            tac->b  = (uintptr_t)vy;
+            tac->d  = vx;
+            tac->a  = vx;
+            tac->b  = vy;
             break;
         case 0x4: // add
-            tac->op = c8ci_add;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
-            tac->b  = (uintptr_t)vy;
+            tac->op = vf_dead ? c8ci_add_nf : c8ci_add;
+            tac->d  = vx;
+            tac->a  = vx;
+            tac->b  = vy;
             break;
         case 0x5: // sub
-            tac->op = c8ci_sub;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
-            tac->b  = (uintptr_t)vy;
+            tac->op = vf_dead ? c8ci_sub_nf : c8ci_sub;
+            tac->d  = vx;
+            tac->a  = vx;
+            tac->b  = vy;
             break;
         case 0x6: // shr
             // XXX: doc says vx = vy >> 1, vf = vy &1
-            tac->op = c8ci_shr;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
+            tac->op = vf_dead ? c8ci_shr_nf : c8ci_shr;
+            tac->d  = vx;
+            tac->a  = vx;
             break;
         case 0x7: // subn
-            tac->op = c8ci_sub;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vy;
-            tac->b  = (uintptr_t)vx;
+            tac->op = vf_dead ? c8ci_sub_nf : c8ci_subn;
+            tac->d  = vx;
+            tac->a  = vy;
+            tac->b  = vx;
             break;
         case 0xe: // shl
             // XXX: doc says vx = vy << 1, vf = vy >> 7
-            tac->op = c8ci_shl;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)vx;
+            tac->op = vf_dead ? c8ci_shl_nf : c8ci_shl;
+            tac->d  = vx;
+            tac->a  = vx;
             break;
         }
         break;
     }
     case 0x9: // sne vx, vy
         tac->op = c8ci_sne;
-        tac->a  = (uintptr_t)vx;
-        tac->b  = (uintptr_t)vy;
+        tac->a  = vx;
+        tac->b  = vy;
         break;
     case 0xa: // ld i, nnn
         tac->op = c8ci_ld_kk;
-        tac->d  = (uintptr_t)&c8->i;
+        tac->d  = C8CI_OFF(i);
         tac->a  = nnn;
         break;
     case 0xb: // jp v0, addr
         tac->op = c8ci_jp_nnn;
-        tac->a  = (uintptr_t)vx;
+        tac->a  = C8CI_V(0);
         tac->b  = nnn;
         break;
     case 0xc: // rnd vx, byte
         tac->op = c8ci_rnd;
-        tac->d  = (uintptr_t)vx;
+        tac->d  = vx;
         tac->a  = kk;
         break;
     case 0xd: // drw vx, vy, nibble
         tac->op = c8ci_drw;
-        tac->d  = (uintptr_t)vx;
-        tac->a  = (uintptr_t)vy;
+        tac->d  = vx;
+        tac->a  = vy;
         tac->b  = instr & 0xf;
         break;
     case 0xe: // op vx
@@ -320,11 +446,11 @@ static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS)
         {
         case 0x9e: // skp vx
             tac->op = c8ci_skp;
-            tac->a  = (uintptr_t)vx;
+            tac->a  = vx;
             break;
         case 0xa1: // sknp vx
             tac->op = c8ci_sknp;
-            tac->a  = (uintptr_t)vx;
+            tac->a  = vx;
             break;
         }
         break;
@@ -333,85 +459,133 @@ static void c8ci_translate(chip8_t *c8, C8CI_OP_ARGS)
         {
         case 0x07: // ld vx, dt
             tac->op = c8ci_ld;
-            tac->d  = (uintptr_t)vx;
-            tac->a  = (uintptr_t)&c8->dt;
+            tac->d  = vx;
+            tac->a  = C8CI_OFF(dt);
             break;
         case 0x0a: // ld vx, key
         {
             tac->op = c8ci_ld_key;
-            tac->d  = (uintptr_t)vx;
+            tac->d  = vx;
             break;
         }
         case 0x15: // ld dt, vx
             tac->op = c8ci_ld;
-            tac->d  = (uintptr_t)&c8->dt;
-            tac->a  = (uintptr_t)vx;
+            tac->d  = C8CI_OFF(dt);
+            tac->a  = vx;
             break;
         case 0x18: // ld st, vx
             tac->op = c8ci_ld;
-            tac->d  = (uintptr_t)&c8->st;
-            tac->a  = (uintptr_t)vx;
+            tac->d  = C8CI_OFF(st);
+            tac->a  = vx;
             break;
         case 0x1e: // add i, vx
             tac->op = c8ci_add;
-            tac->d  = (uintptr_t)&c8->i;
-            tac->a  = (uintptr_t)&c8->i;
-            tac->b  = (uintptr_t)vx;
+            tac->d  = C8CI_OFF(i);
+            tac->a  = C8CI_OFF(i);
+            tac->b  = vx;
             break;
         case 0x29: // ld f, vx
             tac->op = c8ci_ld_f;
-            tac->d  = (uintptr_t)&c8->i;
-            tac->a  = (uintptr_t)vx;
+            tac->d  = C8CI_OFF(i);
+            tac->a  = vx;
             break;
         case 0x33: // ld b, vx
             tac->op = c8ci_ld_bcd;
-            tac->a  = (uintptr_t)x;
+            tac->a  = vx;
             break;
         case 0x55: // ld [i], vx
             tac->op = c8ci_ld_r2m;
-            tac->a  = (uintptr_t)x;
+            tac->a  = x;
             break;
         case 0x65: // ld vx, [i]
             tac->op = c8ci_ld_m2r;
-            tac->a  = (uintptr_t)x;
+            tac->a  = x;
             break;
         }
         break;
     }
 
+    c8_code_mark(c8, c8->pc, (instr >> 12) == 0x8 && vf_dead ? C8CI_REACH : 2);
+
     tac->op(c8, tac->d, tac->a, tac->b);
 }
 
 
+/*
+ * Runs the instruction at pc. A dropped flag is overwritten at most
+ * C8CI_VF_WINDOW instructions later, the 8xyN ops with fewer cycles left than
+ * that run on the naive step so vf is right whenever the caller stops.
+ */
+static inline void c8ci_exec(chip8_t *c8)
+{
+    if (c8->cycles <= C8CI_VF_WINDOW && c8->ram[c8->pc] >> 4 == 0x8)
+    {
+        c8_naive_step(c8);
+        return;
+    }
+
+    // translating or a store may have moved the cache to a private copy
+    const c8ci_tac_t *tac = &((const c8ci_t*)c8->ci)->cache[c8->pc];
+    tac->op(c8, tac->d, tac->a, tac->b);
+
+    c8->run_time++;
+    c8->cycles--;
+}
+
 static void c8_ci_step(chip8_t *c8)
 {
     while (c8->cycles)
     {
-        const c8ci_tac_t *tac = &c8ci_cache[c8->pc];
-        tac->op(c8, tac->d, tac->a, tac->b);
-
-        c8->run_time++;
-        c8->cycles--;
+        c8->pc &= 0xfff;
+        c8ci_exec(c8);
+    }
+}
 
-        if ((c8->run_time % (CHIP8_CLOCK/60)) == 0)
-        {
-            if (c8->dt)
-                c8->dt--;
+static void c8_ci_new(chip8_t *c8);
 
-            if (c8->st)
-                c8->st--;
-        }
+static void c8_ci_reset(chip8_t *c8)
+{
+    c8ci_t *ci = (c8ci_t*)c8->ci;
 
-        c8->poll(c8->kbd, c8->poll_data);
+    // a fresh cache is cheaper than a copy to clear
+    if (__atomic_load_n(&ci->refs, __ATOMIC_ACQUIRE) > 1)
+    {
+        c8ci_release(ci);
+        c8_ci_new(c8);
+        return;
     }
+
+    c8ci_invalidate(c8, 0, 4096);
 }
 
 static void c8_ci_new(chip8_t *c8)
 {
+    c8ci_t *ci = (c8ci_t*)calloc(1, sizeof(c8ci_t));
 
+    if (!ci)
+    {
+        fprintf(stderr, "ci: out of memory\n");
+        exit(1);
+    }
+
+    ci->refs = 1;
+    c8->ci   = ci;
+
+    c8_ci_reset(c8);
 }
 
-static void c8_ci_free(chip8_t *c8)
+/* clone->ci is NULL or a cache of its own, which is dropped */
+static void c8_ci_clone(chip8_t *clone, chip8_t *c8)
 {
+    if (clone->ci)
+        c8ci_release((c8ci_t*)clone->ci);
 
+    clone->ci = c8->ci;
+    __atomic_add_fetch(&((c8ci_t*)c8->ci)->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void c8_ci_free(chip8_t *c8)
+{
+    c8ci_release((c8ci_t*)c8->ci);
+    c8->ci = NULL;
 }
@@ -2,25 +2,184 @@
 #include <stddef.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <pthread.h>
 #include "sljit/sljitLir.h"
 
 /*
- * This is a really ineffective dynarec. Every Chip-8 instruction gets compiled
- * to a native function.
+ * A block based dynarec. Straight-line runs of Chip-8 instructions are
+ * compiled into a single native function which ends at the first jump, call,
+ * ret, skip or draw. pc and cycles are only updated once, when the block
+ * exits. A block returns right away if it doesn't fit in cycles, c8_dyn_step
+ * then interprets what is left so no block runs past a deadline.
+ *
+ * Blocks ending in a jump or call to a constant address are chained: their
+ * exit is a rewritable jump which is patched to go straight into the target
+ * block once it is translated, and back to the return stub when the target is
+ * invalidated. All blocks share the same frame, so chained blocks enter right
+ * after the prologue.
+ *
+ * The most used V registers and I of a block are kept in saved registers
+ * (S1 and up) for the whole block. They are loaded after the prologue, written
+ * back before helpers that access them through chip8_t and at block exit.
+ *
+ * VF is tracked backwards through the block, and arithmetic whose flag is
+ * overwritten before being read does not compute it. VF is assumed to be read
+ * after the block exits.
+ *
+ * c8_clone freezes the blocks translated so far into a base set shared by both
+ * instances, each getting an empty set of its own on top. Lookups fall through
+ * to the bases, new blocks go to the top set and only chain within it. The
+ * first write that hits a base block drops all the bases of that instance.
+ *
+ * A block can also be compiled by a thread shared by all instances, see
+ * c8dyn_submit. It works from a copy of ram and into space the instance sets
+ * aside, the instance puts the block in its cache once it is done.
  */
 
-typedef void SLJIT_CALL (*c8dyn_op_t)(chip8_t *c8);
+#define C8DYN_MAX_BLOCK 32 /* instructions */
+#define C8DYN_NO_LINK   0xffff
 
-typedef struct {
-    struct sljit_compiler *c;
-    c8dyn_op_t cache[4096];
-} c8dyn_t;
+/*
+ * Code is bump allocated from regions owned by its set, aligned to their size
+ * so a block finds its region by masking its address. A region is reused once
+ * all its blocks are freed, and a set that has used up its budget, by default
+ * C8DYN_MAX_REGIONS, evicts one whole to make room.
+ *
+ * The victim is picked by a clock going from the oldest region to the newest.
+ * Regions with a block entered from c8_dyn_step since the clock last passed get
+ * a second chance, which keeps the blocks a game keeps coming back to. Blocks
+ * only reached through chained exits don't count, a region is kept for as
+ * long as the loop it holds is where cycles run out.
+ */
+#define C8DYN_REGION_SIZE (64 * 1024)
+#define C8DYN_MAX_REGIONS 8
+#define C8DYN_CODE_ALIGN  16
+
+/* S0 holds the chip8_t, the rest cache guest registers */
+#define C8DYN_SAVEDS    (SLJIT_NUMBER_OF_SAVED_REGISTERS < 6 ? SLJIT_NUMBER_OF_SAVED_REGISTERS : 6)
 
-#define c8dyn_def_begin(name) static void c8dyn_##name(chip8_t *c8, C8DYN_OP_ARGS) { c8->pc += 2;
-#define c8dyn_def_end(name) }
+#define C8DYN_ALL_REGS  (0xffffu | CHIP8_REG_BIT(CHIP8_I))
+
+typedef void SLJIT_CALL (*c8dyn_op_t)(chip8_t *c8);
 
+typedef struct {
+    c8dyn_op_t fn;
+    sljit_uw   body;     /* first instruction after the prologue */
+    uint16_t   end;      /* first address after the block */
+
+    /* chained exit */
+    uint16_t   target;   /* C8DYN_NO_LINK if the exit is not chained */
+    sljit_uw   link;     /* address of the rewritable jump */
+    sljit_uw   unlinked; /* return stub the jump goes to while unlinked */
+
+    uint16_t   links;    /* first block chained to this address */
+    uint16_t   next;     /* next block chained to the same target */
+} c8dyn_block_t;
+
+typedef struct c8dyn c8dyn_t;
+typedef struct c8dyn_region c8dyn_region_t;
+
+struct c8dyn_region {
+    c8dyn_t        *dyn;  /* set owning the blocks */
+    c8dyn_region_t *next; /* older region */
+    size_t          used; /* bytes handed out, this header included */
+    unsigned        live; /* blocks not freed yet */
+    bool            entered; /* a block was entered since the clock passed */
+};
 
-static inline void c8dyn_write_reg(struct sljit_compiler *c, uint8_t reg, sljit_si src, sljit_si srcw)
+/*
+ * Code starts on the next cache line, c8_dyn_step sets entered between blocks
+ * and a store to a line holding code makes the cpu flush its pipeline.
+ */
+#define C8DYN_LINE          64
+#define C8DYN_REGION_HEADER ((sizeof(c8dyn_region_t) + C8DYN_LINE - 1) & ~(size_t)(C8DYN_LINE - 1))
+
+/* code set aside for a block compiled in the background, the largest take about 1.5 KB */
+#define C8DYN_JOB_CODE 4096
+
+enum {
+    C8DYN_JOB_QUEUED,
+    C8DYN_JOB_RUNNING,
+    C8DYN_JOB_DONE
+};
+
+typedef struct c8dyn_job c8dyn_job_t;
+
+struct c8dyn_job {
+    c8dyn_job_t  *next;  /* next in the queue of the compiler thread */
+    c8dyn_t      *dyn;
+    int           state; /* C8DYN_JOB_*, the compiler thread moves it on */
+    bool          busy;  /* submitted and not finished, only used by the instance */
+    uint16_t      start;
+    void         *code;  /* C8DYN_JOB_CODE bytes the block is compiled into */
+    c8dyn_block_t block; /* fn is NULL if compiling failed */
+    sljit_uw      size;
+    uint8_t       ram[CHIP8_RAM_SIZE]; /* as it was when submitted */
+};
+
+struct c8dyn {
+    struct sljit_compiler *c;
+    c8dyn_block_t cache[4096];
+    unsigned      nblocks;
+
+    /* frozen blocks looked up after these, shared with other instances */
+    c8dyn_t      *base;
+    unsigned      refs;    /* instances using this set, on top or as a base */
+    c8dyn_t      *retired; /* bases dropped while running, released once the block returns */
+
+    /* target of the chained exit of the block being translated */
+    uint16_t target;
+
+    /* registers of the block being translated */
+    sljit_si host[CHIP8_I + 1]; /* host register caching a guest one */
+    uint32_t cached;            /* guest registers held in host registers */
+    uint32_t dirty;             /* cached registers not written back yet */
+    bool     vf_dead;           /* the flag of the current instruction is never read */
+
+    /* code invalidated while running, freed once the block returns */
+    void    *dead[4096];
+    unsigned ndead;
+
+    /* code memory, newest region first */
+    c8dyn_region_t *regions;
+    c8dyn_region_t *spare; /* emptied region kept for the next one needed */
+    unsigned        nregions;
+    unsigned        max_regions; /* budget, the spare counts against it */
+
+    /* carried over to the new top set by c8_dyn_clone */
+    chip8_code_stats_t stats;
+    uint32_t           seen[4096 / 32]; /* addresses translated since the last reset */
+
+    /* per address, for chip8_tier.h */
+    uint16_t heat[4096];   /* times interpreted */
+    uint8_t  strikes[4096]; /* blocks starting there dropped by a write */
+
+    /* the block being compiled in the background, uses the registers above */
+    c8dyn_job_t job;
+};
+
+/* the set sljit_generate_code allocates for, see c8dyn_exec_alloc */
+static __thread c8dyn_t *c8dyn_compiling;
+static __thread void    *c8dyn_reserved; /* space of the job being compiled */
+
+/* the compiler thread, started by the first c8dyn_submit */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  queued, done;
+    c8dyn_job_t    *head, *tail;
+    bool            started;
+} c8dyn_worker = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, false };
+
+static pthread_once_t c8dyn_warmed_up = PTHREAD_ONCE_INIT;
+
+/* what the translator does after an instruction is emitted */
+enum {
+    C8DYN_NEXT, /* keep going */
+    C8DYN_END,  /* end the block, pc is the next instruction */
+    C8DYN_EXIT  /* end the block, pc was already set */
+};
+
+static inline void c8dyn_write_reg(c8dyn_t *dyn, uint8_t reg, sljit_si src, sljit_si srcw)
 {
     sljit_si op  = SLJIT_MOV_UB;
     sljit_si dstw = SLJIT_OFFSETOF(chip8_t, v) + reg;
@@ -31,6 +190,15 @@ static inline void c8dyn_write_reg(struct sljit_compiler *c, uint8_t reg, sljit_
         exit(1);
     }
 
+    if (reg <= CHIP8_I && (dyn->cached & CHIP8_REG_BIT(reg)))
+    {
+        // zero extends, so the host register always holds a valid value
+        op = (reg == CHIP8_I) ? SLJIT_MOV_UH : SLJIT_MOV_UB;
+        sljit_emit_op1(dyn->c, op, dyn->host[reg], 0, src, srcw);
+        dyn->dirty |= CHIP8_REG_BIT(reg);
+        return;
+    }
+
     if (reg == CHIP8_I)
     {
         op   = SLJIT_MOV_UH;
@@ -46,10 +214,10 @@ static inline void c8dyn_write_reg(struct sljit_compiler *c, uint8_t reg, sljit_
     else if (reg == CHIP8_ST)
         dstw = SLJIT_OFFSETOF(chip8_t, st);
 
-    sljit_emit_op1(c, op, SLJIT_MEM1(SLJIT_S0), dstw, src, srcw);
+    sljit_emit_op1(dyn->c, op, SLJIT_MEM1(SLJIT_S0), dstw, src, srcw);
 }
 
-static inline void c8dyn_read_reg(struct sljit_compiler *c, bool expand, uint8_t reg, sljit_si dst, sljit_si dstw)
+static inline void c8dyn_read_reg(c8dyn_t *dyn, bool expand, uint8_t reg, sljit_si dst, sljit_si dstw)
 {
     sljit_si op  = SLJIT_MOV_UB;
     sljit_si srcw = SLJIT_OFFSETOF(chip8_t, v) + reg;
@@ -60,6 +228,13 @@ static inline void c8dyn_read_reg(struct sljit_compiler *c, bool expand, uint8_t
         exit(1);
     }
 
+    if (reg <= CHIP8_I && (dyn->cached & CHIP8_REG_BIT(reg)))
+    {
+        if (dst != dyn->host[reg] || dstw != 0)
+            sljit_emit_op1(dyn->c, SLJIT_MOV, dst, dstw, dyn->host[reg], 0);
+        return;
+    }
+
     if (reg == CHIP8_I)
     {
         op   = SLJIT_MOV_UH;
@@ -75,25 +250,394 @@ static inline void c8dyn_read_reg(struct sljit_compiler *c, bool expand, uint8_t
     else if (reg == CHIP8_ST)
         srcw = SLJIT_OFFSETOF(chip8_t, st);
 
-    sljit_emit_op1(c, op | (expand ? SLJIT_INT_OP : 0), dst, dstw, SLJIT_MEM1(SLJIT_S0), srcw);
+    sljit_emit_op1(dyn->c, op | (expand ? SLJIT_INT_OP : 0), dst, dstw, SLJIT_MEM1(SLJIT_S0), srcw);
+}
+
+/* returns the host register holding reg, loading it into tmp if it is not cached */
+static inline sljit_si c8dyn_src_reg(c8dyn_t *dyn, uint8_t reg, sljit_si tmp)
+{
+    if (reg <= CHIP8_I && (dyn->cached & CHIP8_REG_BIT(reg)))
+        return dyn->host[reg];
+
+    c8dyn_read_reg(dyn, false, reg, tmp, 0);
+    return tmp;
+}
+
+/* writes back the dirty cached registers in mask */
+static void c8dyn_spill(c8dyn_t *dyn, uint32_t mask)
+{
+    uint32_t spill = dyn->dirty & mask;
+
+    for (uint8_t reg = 0; reg <= CHIP8_I; ++reg)
+    {
+        if (!(spill & CHIP8_REG_BIT(reg)))
+            continue;
+
+        if (reg == CHIP8_I)
+            sljit_emit_op1(dyn->c, SLJIT_MOV_UH, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, i), dyn->host[reg], 0);
+        else
+            sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, v) + reg, dyn->host[reg], 0);
+    }
+
+    dyn->dirty &= ~spill;
+}
+
+/* reloads the cached registers in mask after a helper changed them */
+static void c8dyn_reload(c8dyn_t *dyn, uint32_t mask)
+{
+    uint32_t reload = dyn->cached & mask;
+
+    for (uint8_t reg = 0; reg <= CHIP8_I; ++reg)
+    {
+        if (!(reload & CHIP8_REG_BIT(reg)))
+            continue;
+
+        if (reg == CHIP8_I)
+            sljit_emit_op1(dyn->c, SLJIT_MOV_UH, dyn->host[reg], 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, i));
+        else
+            sljit_emit_op1(dyn->c, SLJIT_MOV_UB, dyn->host[reg], 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, v) + reg);
+    }
+
+    dyn->dirty &= ~reload;
+}
+
+/* points every block chained to addr at its return stub or at addr's code */
+static void c8dyn_patch_links(c8dyn_t *dyn, uint16_t addr)
+{
+    c8dyn_block_t *target = &dyn->cache[addr];
+
+    for (uint16_t i = target->links; i != C8DYN_NO_LINK; i = dyn->cache[i].next)
+    {
+        c8dyn_block_t *block = &dyn->cache[i];
+
+        sljit_set_jump_addr(block->link, target->fn ? target->body : block->unlinked);
+    }
+}
+
+static void c8dyn_link(c8dyn_t *dyn, uint16_t addr)
+{
+    c8dyn_block_t *block = &dyn->cache[addr];
+
+    // the target might already be translated, this block included
+    if (block->target != C8DYN_NO_LINK)
+    {
+        block->next = dyn->cache[block->target].links;
+        dyn->cache[block->target].links = addr;
+
+        c8dyn_patch_links(dyn, block->target);
+    }
+
+    c8dyn_patch_links(dyn, addr);
+}
+
+static void c8dyn_unlink(c8dyn_t *dyn, uint16_t addr)
+{
+    c8dyn_block_t *block = &dyn->cache[addr];
+
+    if (block->target != C8DYN_NO_LINK)
+    {
+        uint16_t *i = &dyn->cache[block->target].links;
+
+        while (*i != addr)
+            i = &dyn->cache[*i].next;
+
+        *i = block->next;
+        block->target = C8DYN_NO_LINK;
+    }
+
+    // nobody can jump here anymore
+    block->fn = NULL;
+    c8dyn_patch_links(dyn, addr);
+}
+
+static c8dyn_region_t *c8dyn_region_of(const void *code)
+{
+    return (c8dyn_region_t*)((uintptr_t)code & ~(uintptr_t)(C8DYN_REGION_SIZE - 1));
+}
+
+static c8dyn_region_t *c8dyn_map_region(void)
+{
+    // twice the size to find an aligned region inside, the rest is unmapped
+    uint8_t *map = (uint8_t*)mmap(NULL, 2 * C8DYN_REGION_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint8_t *region;
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    region = (uint8_t*)c8dyn_region_of(map + C8DYN_REGION_SIZE - 1);
+
+    if (region > map)
+        munmap(map, region - map);
+    munmap(region + C8DYN_REGION_SIZE, map + C8DYN_REGION_SIZE - region);
+
+    return (c8dyn_region_t*)region;
+}
+
+/* gives back every region but the newest, which is emptied */
+static void c8dyn_trim_regions(c8dyn_t *dyn)
+{
+    c8dyn_region_t *region = dyn->regions;
+
+    if (!region)
+        return;
+
+    while (region->next)
+    {
+        c8dyn_region_t *next = region->next->next;
+
+        munmap(region->next, C8DYN_REGION_SIZE);
+        region->next = next;
+    }
+
+    region->used  = C8DYN_REGION_HEADER;
+    region->live  = 0;
+    dyn->nregions = 1;
+}
+
+/* drops all the blocks in the region, only between blocks with nothing left to reap */
+static void c8dyn_evict(c8dyn_t *dyn, c8dyn_region_t *region)
+{
+    for (int i = 0; i < 4096; ++i)
+    {
+        if (dyn->cache[i].fn && c8dyn_region_of((void*)dyn->cache[i].fn) == region)
+        {
+            dyn->nblocks--;
+            dyn->stats.evictions++;
+            c8dyn_unlink(dyn, i);
+        }
+    }
+}
+
+/* unlinks the region the clock stops at, entered ones go back to the front */
+static c8dyn_region_t *c8dyn_clock(c8dyn_t *dyn)
+{
+    while (1)
+    {
+        c8dyn_region_t **last = &dyn->regions;
+        c8dyn_region_t  *region;
+
+        while ((*last)->next)
+            last = &(*last)->next;
+
+        region = *last;
+        *last  = NULL;
+
+        // once all had their chance the oldest goes, whatever it still holds
+        if (!region->entered || !dyn->regions)
+            return region;
+
+        region->entered = false;
+        region->next    = dyn->regions;
+        dyn->regions    = region;
+    }
+}
+
+static c8dyn_region_t *c8dyn_new_region(c8dyn_t *dyn)
+{
+    c8dyn_region_t *region = dyn->spare;
+
+    if (dyn->nregions >= dyn->max_regions)
+    {
+        region = c8dyn_clock(dyn);
+        c8dyn_evict(dyn, region);
+    }
+    else
+    {
+        if (region)
+            dyn->spare = NULL;
+        else if (!(region = c8dyn_map_region()))
+            return NULL;
+
+        dyn->nregions++;
+    }
+
+    region->dyn  = dyn;
+    region->used    = C8DYN_REGION_HEADER;
+    region->live    = 0;
+    region->entered = false;
+    region->next    = dyn->regions;
+    dyn->regions    = region;
+
+    return region;
+}
+
+/* align is a power of two, at least C8DYN_CODE_ALIGN */
+static void *c8dyn_alloc(c8dyn_t *dyn, size_t size, size_t align)
+{
+    c8dyn_region_t *region = dyn->regions;
+    size_t          used;
+    void           *code;
+
+    size = (size + C8DYN_CODE_ALIGN - 1) & ~(size_t)(C8DYN_CODE_ALIGN - 1);
+
+    if (size > C8DYN_REGION_SIZE - C8DYN_REGION_HEADER)
+        return NULL;
+
+    used = region ? (region->used + align - 1) & ~(align - 1) : 0;
+
+    if (!region || used + size > C8DYN_REGION_SIZE)
+    {
+        if (!(region = c8dyn_new_region(dyn)))
+            return NULL;
+
+        used = C8DYN_REGION_HEADER;
+    }
+
+    code = (uint8_t*)region + used;
+    region->used = used + size;
+    region->live++;
+
+    return code;
+}
+
+/* SLJIT_MALLOC_EXEC, only called from sljit_generate_code in c8dyn_compile */
+void *c8dyn_exec_alloc(size_t size)
+{
+    // the compiler thread only writes where the instance told it to
+    if (c8dyn_reserved)
+        return size <= C8DYN_JOB_CODE ? c8dyn_reserved : NULL;
+
+    return c8dyn_alloc(c8dyn_compiling, size, C8DYN_CODE_ALIGN);
+}
+
+/* SLJIT_FREE_EXEC, regions are recycled as soon as they are empty */
+void c8dyn_exec_free(void *code)
+{
+    c8dyn_region_t  *region = c8dyn_region_of(code);
+    c8dyn_t         *dyn    = region->dyn;
+    c8dyn_region_t **i;
+
+    if (--region->live)
+        return;
+
+    if (region == dyn->regions)
+    {
+        region->used = C8DYN_REGION_HEADER;
+        return;
+    }
+
+    for (i = &dyn->regions; *i != region; i = &(*i)->next)
+        ;
+
+    *i = region->next;
+    dyn->nregions--;
+
+    if (dyn->spare)
+        munmap(region, C8DYN_REGION_SIZE);
+    else
+        dyn->spare = region;
+}
+
+/* true if any block from first to end runs into begin */
+static bool c8dyn_overlaps(const c8dyn_t *dyn, int first, uint16_t begin, uint16_t end)
+{
+    for (int i = first; i <= end; ++i)
+    {
+        if (dyn->cache[i].fn && dyn->cache[i].end > begin)
+            return true;
+    }
+
+    return false;
 }
 
 static void SLJIT_CALL c8dyn_invalidate(chip8_t *c8, uint16_t begin, uint16_t end)
 {
     c8dyn_t *dyn = (c8dyn_t*)c8->dyn;
+    int first;
+
+    /* ranges based on i wrap around the end of ram */
+    end    = (begin & 0xfff) + (uint16_t)(end - begin);
+    begin &= 0xfff;
+
+    if (end > 0xfff)
+    {
+        c8dyn_invalidate(c8, 0, end & 0xfff);
+        end = 0xfff;
+    }
+
+    /* tiered instances also interpret some of the code, that goes too */
+    if (c8->backend == CHIP8_BACKEND_TIERED)
+        c8ci_invalidate(c8, begin, end + 1);
 
-    end &= 0xfff;
+    /* nothing depends on the range anymore once this returns */
+    c8_code_clear(c8, begin, end - begin + 1);
 
-    for (uint16_t i = begin; i <= end; ++i)
+    /* blocks starting before begin may still run into the range */
+    first = (int)begin - (C8DYN_MAX_BLOCK * 2 - 1);
+    if (first < 0)
+        first = 0;
+
+    for (int i = first; i <= end; ++i)
+    {
+        c8dyn_block_t *block = &dyn->cache[i];
+
+        if (block->fn && block->end > begin)
+        {
+            /* the block may be the one calling us, let c8_dyn_step free it */
+            dyn->dead[dyn->ndead++] = (void*)block->fn;
+            dyn->nblocks--;
+            c8dyn_unlink(dyn, i);
+
+            // it has to get hot again, if the tier keeps translating it at all
+            dyn->heat[i] = 0;
+            if (dyn->strikes[i] != 255)
+                dyn->strikes[i]++;
+        }
+    }
+
+    /* bases can't change, this instance stops using them instead */
+    for (const c8dyn_t *base = dyn->base; base; base = base->base)
     {
-        if (dyn->cache[i])
+        if (c8dyn_overlaps(base, first, begin, end))
         {
-            sljit_free_code((void*)dyn->cache[i]);
-            dyn->cache[i] = NULL;
+            dyn->retired = dyn->base;
+            dyn->base    = NULL;
+            break;
         }
     }
 }
 
+/* frees the set once no instance uses it anymore, with the bases only it used */
+static void c8dyn_release(c8dyn_t *dyn)
+{
+    while (dyn && __atomic_sub_fetch(&dyn->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        c8dyn_t *base = dyn->base;
+
+        // the blocks go with their regions
+        c8dyn_trim_regions(dyn);
+
+        if (dyn->regions)
+            munmap(dyn->regions, C8DYN_REGION_SIZE);
+        if (dyn->spare)
+            munmap(dyn->spare, C8DYN_REGION_SIZE);
+
+        free(dyn);
+        dyn = base;
+    }
+}
+
+static c8dyn_op_t c8dyn_lookup(const c8dyn_t *dyn, uint16_t addr)
+{
+    for (; dyn; dyn = dyn->base)
+    {
+        if (dyn->cache[addr].fn)
+            return dyn->cache[addr].fn;
+    }
+
+    return NULL;
+}
+
+static void c8dyn_reap(c8dyn_t *dyn)
+{
+    while (dyn->ndead)
+        sljit_free_code(dyn->dead[--dyn->ndead]);
+
+    c8dyn_release(dyn->retired);
+    dyn->retired = NULL;
+}
+
 static void SLJIT_CALL c8dyn_jump(chip8_t *c8, uint16_t addr)
 {
     c8_jump(c8, addr);
@@ -115,11 +659,26 @@ static void SLJIT_CALL c8dyn_draw(chip8_t *c8, uint16_t xy, uint8_t nrows)
     c8_draw(c8, xy >> 8, xy & 0xFF, nrows);
 }
 
+static uint8_t SLJIT_CALL c8dyn_test_key(chip8_t *c8, uint8_t key)
+{
+    const uint8_t pressed = c8->kbd[key & 0xf];
+
+    c8_input_sync(c8);
+    return pressed;
+}
+
 static uint8_t SLJIT_CALL c8dyn_wait_key(chip8_t *c8)
 {
     return c8_wait_key(c8);
 }
 
+/* head is where the loop starts, fx0a only gets there while no key is pressed */
+static void SLJIT_CALL c8dyn_idle_skip(chip8_t *c8, uint16_t head)
+{
+    if ((c8->pc & 0xfff) == head)
+        c8_idle_skip(c8, 0);
+}
+
 static void SLJIT_CALL c8dyn_load_bcd(chip8_t *c8, uint8_t val)
 {
     c8_load_bcd(c8, val);
@@ -130,11 +689,6 @@ static void SLJIT_CALL c8dyn_load_ram(chip8_t *c8, bool from_ram, uint8_t x)
     c8_load_ram(c8, from_ram, x);
 }
 
-static uint8_t SLJIT_CALL c8dyn_rnd(chip8_t *c8, uint8_t mask)
-{
-    return rand() & mask;
-}
-
 static void SLJIT_CALL c8dyn_cls(chip8_t *c8)
 {
     c8_clear(c8);
@@ -166,76 +720,90 @@ static void dump_code(void *code, sljit_uw len)
 #endif
 }
 
-static c8dyn_op_t c8dyn_emit_cls(chip8_t *c8, c8dyn_t *dyn)
+static int c8dyn_emit_cls(c8dyn_t *dyn)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 1, 1, 0, 0, 0);
-
     // R0 = S0; c8_clear(R0);
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
     sljit_emit_ijump(dyn->c, SLJIT_CALL1, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_cls));
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 }
 
-static c8dyn_op_t c8dyn_emit_ret(chip8_t *c8, c8dyn_t *dyn)
+static int c8dyn_emit_ret(c8dyn_t *dyn)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 1, 1, 0, 0, 0);
-
     // R0 = S0; c8_pop(R0);
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
     sljit_emit_ijump(dyn->c, SLJIT_CALL1, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_ret));
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_EXIT;
 }
 
-static c8dyn_op_t c8dyn_emit_jp_nnn(chip8_t *c8, c8dyn_t *dyn, uint16_t nnn)
+static int c8dyn_emit_jp_nnn(c8dyn_t *dyn, uint16_t next, uint16_t nnn)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
+    unsigned state = 0;
 
-    // R0 = S0; R1 = nnn; c8_jump(R0, R1);
-    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-    sljit_emit_op1(dyn->c, SLJIT_MOV_UH, SLJIT_R1, 0, SLJIT_IMM, nnn & 0xfff);
-    sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_jump));
+    nnn &= 0xfff;
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    // the target is constant, so c8_jump's checks can be done right now
+    if (nnn == next - 2)
+        state |= CHIP8_STATE_HALT;
+
+    if (nnn < 0x200)
+        state |= CHIP8_STATE_ILEGAL;
+
+    if (state)
+        sljit_emit_op2(dyn->c, SLJIT_IOR, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, state),
+                       SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, state), SLJIT_IMM, state);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, nnn);
+    dyn->target = nnn;
+
+    return C8DYN_EXIT;
 }
 
-static c8dyn_op_t c8dyn_emit_jp_disp(chip8_t *c8, c8dyn_t *dyn, uint16_t nnn)
+static int c8dyn_emit_jp_disp(c8dyn_t *dyn, uint16_t next, uint16_t nnn)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
+    // c8_jump checks the target against pc
+    c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, next);
 
     // R0 = S0; R1 = S0->v[x] + nnn; c8_jump(R0, R1);
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-    c8dyn_read_reg(dyn->c, true, CHIP8_V0, SLJIT_R1, 0);
+    c8dyn_read_reg(dyn, true, CHIP8_V0, SLJIT_R1, 0);
     sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, nnn & 0xfff);
     sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_jump));
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_EXIT;
 }
 
-static c8dyn_op_t c8dyn_emit_call_nnn(chip8_t *c8, c8dyn_t *dyn, uint16_t nnn)
+static int c8dyn_emit_call_nnn(c8dyn_t *dyn, uint16_t next, uint16_t nnn)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
+    // c8_push saves pc
+    c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, next);
 
     // R0 = S0; R1 = nnn; c8dyn_call(R0, R1);
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
     sljit_emit_op1(dyn->c, SLJIT_MOV_UH, SLJIT_R1, 0, SLJIT_IMM, nnn & 0xfff);
     sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_call));
+    dyn->target = nnn & 0xfff;
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    return C8DYN_EXIT;
+}
+
+/* S0->pc = next, or next + 2 if the comparison emitted right before jumps */
+static void c8dyn_emit_skip(c8dyn_t *dyn, struct sljit_jump *skip, uint16_t next)
+{
+    struct sljit_jump *done;
+
+    c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, next);
+    done = sljit_emit_jump(dyn->c, SLJIT_JUMP);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    sljit_set_label(skip, sljit_emit_label(dyn->c));
+    c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, next + 2);
+
+    sljit_set_label(done, sljit_emit_label(dyn->c));
 }
 
-static c8dyn_op_t c8dyn_emit_cond_kk(chip8_t *c8, c8dyn_t *dyn, bool equal, uint8_t x, uint8_t kk)
+static int c8dyn_emit_cond_kk(c8dyn_t *dyn, uint16_t next, bool equal, uint8_t x, uint8_t kk)
 {
 
     if (x > CHIP8_LAST_V_REG)
@@ -244,27 +812,19 @@ static c8dyn_op_t c8dyn_emit_cond_kk(chip8_t *c8, c8dyn_t *dyn, bool equal, uint
         exit(1);
     }
 
-    struct sljit_jump *dont_skip;
-
-    // because of early return, equal == SLJIT_NOT_EQUAL, !equal == SLJIT_EQUAL
-    sljit_si type = (equal ? SLJIT_NOT_EQUAL : SLJIT_EQUAL);
-
-    sljit_emit_enter(dyn->c, 0, 1, 1, 1, 0, 0, 0);
+    struct sljit_jump *skip;
 
-    // R0 = S0->v[x]; if (type) return; R0 = S0->pc; R0 += 2; S0->pc = R0;
-    c8dyn_read_reg(dyn->c, false, x, SLJIT_R0, 0);
-    dont_skip = sljit_emit_cmp(dyn->c, type, SLJIT_R0, 0, SLJIT_IMM, kk);
-    c8dyn_read_reg(dyn->c, true, CHIP8_PC, SLJIT_R0, 0);
-    sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 2);
-    c8dyn_write_reg(dyn->c, CHIP8_PC, SLJIT_R0, 0);
+    sljit_si type = (equal ? SLJIT_EQUAL : SLJIT_NOT_EQUAL);
 
-    sljit_set_label(dont_skip, sljit_emit_label(dyn->c));
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    // R0 = S0->v[x]; if (type) S0->pc = next + 2; else S0->pc = next;
+    c8dyn_read_reg(dyn, false, x, SLJIT_R0, 0);
+    skip = sljit_emit_cmp(dyn->c, type, SLJIT_R0, 0, SLJIT_IMM, kk);
+    c8dyn_emit_skip(dyn, skip, next);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_EXIT;
 }
 
-static c8dyn_op_t c8dyn_emit_cond(chip8_t *c8, c8dyn_t *dyn, bool equal, uint8_t x, uint8_t y)
+static int c8dyn_emit_cond(c8dyn_t *dyn, uint16_t next, bool equal, uint8_t x, uint8_t y)
 {
 
     if (x > CHIP8_LAST_V_REG || y > CHIP8_LAST_V_REG)
@@ -273,39 +833,27 @@ static c8dyn_op_t c8dyn_emit_cond(chip8_t *c8, c8dyn_t *dyn, bool equal, uint8_t
         exit(1);
     }
 
-    struct sljit_jump *dont_skip;
-
-    // because of early return, equal == SLJIT_NOT_EQUAL, !equal == SLJIT_EQUAL
-    sljit_si type = (equal ? SLJIT_NOT_EQUAL : SLJIT_EQUAL);
-
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
+    struct sljit_jump *skip;
 
-    // R0 = S0->v[x]; R1 = S->v[y]; if (type) return; R0 = S0->pc; R0 += 2; S0->pc = R0;
-    c8dyn_read_reg(dyn->c, false, x, SLJIT_R0, 0);
-    c8dyn_read_reg(dyn->c, false, y, SLJIT_R1, 0);
-    dont_skip = sljit_emit_cmp(dyn->c, type, SLJIT_R0, 0, SLJIT_R1, 0);
-    c8dyn_read_reg(dyn->c, true, CHIP8_PC, SLJIT_R0, 0);
-    sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 2);
-    c8dyn_write_reg(dyn->c, CHIP8_PC, SLJIT_R0, 0);
+    sljit_si type = (equal ? SLJIT_EQUAL : SLJIT_NOT_EQUAL);
 
-    sljit_set_label(dont_skip, sljit_emit_label(dyn->c));
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    // R0 = S0->v[x]; R1 = S->v[y]; if (type) S0->pc = next + 2; else S0->pc = next;
+    c8dyn_read_reg(dyn, false, x, SLJIT_R0, 0);
+    c8dyn_read_reg(dyn, false, y, SLJIT_R1, 0);
+    skip = sljit_emit_cmp(dyn->c, type, SLJIT_R0, 0, SLJIT_R1, 0);
+    c8dyn_emit_skip(dyn, skip, next);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_EXIT;
 }
 
-static c8dyn_op_t c8dyn_emit_load_imm(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint16_t imm)
+static int c8dyn_emit_load_imm(c8dyn_t *dyn, uint8_t x, uint16_t imm)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 0, 1, 0, 0, 0);
-
-    c8dyn_write_reg(dyn->c, x, SLJIT_IMM, imm);
-
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    c8dyn_write_reg(dyn, x, SLJIT_IMM, imm);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 }
 
-static c8dyn_op_t c8dyn_emit_add_imm(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8_t imm)
+static int c8dyn_emit_add_imm(c8dyn_t *dyn, uint8_t x, uint8_t imm)
 {
     if (x > CHIP8_LAST_V_REG)
     {
@@ -313,129 +861,81 @@ static c8dyn_op_t c8dyn_emit_add_imm(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8
         exit(1);
     }
 
-    sljit_emit_enter(dyn->c, 0, 1, 1, 1, 0, 0, 0);
-
-    c8dyn_read_reg(dyn->c, false, x, SLJIT_R0, 0);
+    c8dyn_read_reg(dyn, false, x, SLJIT_R0, 0);
     sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, imm);
-    c8dyn_write_reg(dyn->c, x, SLJIT_R0, 0);
+    c8dyn_write_reg(dyn, x, SLJIT_R0, 0);
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 }
 
-static c8dyn_op_t c8dyn_emit_load(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8_t y)
+static int c8dyn_emit_load(c8dyn_t *dyn, uint8_t x, uint8_t y)
 {
-    sljit_si  src, srcw, dst, dstw;
-
-    src = dst = SLJIT_MEM1(SLJIT_S0);
-
-    if (x < CHIP8_NUM_V_REGS)
-        dstw = SLJIT_OFFSETOF(chip8_t, v) + x;
-    else if (x == CHIP8_DT)
-        dstw = SLJIT_OFFSETOF(chip8_t, dt);
-    else if (x == CHIP8_ST)
-        dstw = SLJIT_OFFSETOF(chip8_t, st);
-    else
+    if (x > CHIP8_LAST_V_REG && x != CHIP8_DT && x != CHIP8_ST)
         goto invalid;
 
-    if (y < CHIP8_NUM_V_REGS)
-        srcw = SLJIT_OFFSETOF(chip8_t, v) + y;
-    else if (y == CHIP8_DT)
-        srcw = SLJIT_OFFSETOF(chip8_t, dt);
-    else
+    if (y > CHIP8_LAST_V_REG && y != CHIP8_DT)
         goto invalid;
 
-    sljit_emit_enter(dyn->c, 0, 1, 0, 1, 0, 0, 0);
-
-    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, dst, dstw, src, srcw);
+    // x = y
+    c8dyn_write_reg(dyn, x, c8dyn_src_reg(dyn, y, SLJIT_R0), 0);
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 
 invalid:
     fprintf(stderr, "load: invalid register combination %1x %1x\n", x, y);
     exit(1);
 }
 
-static c8dyn_op_t c8dyn_emit_add(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8_t y)
+static int c8dyn_emit_add(c8dyn_t *dyn, uint8_t x, uint8_t y)
 {
-    sljit_si  src, srcw, dst, dstw, dstop;
-
-    src = dst = SLJIT_MEM1(SLJIT_S0);
+    sljit_si a, b;
 
-    if (x < CHIP8_NUM_V_REGS)
-    {
-        dstw  = SLJIT_OFFSETOF(chip8_t, v) + x;
-        dstop = SLJIT_MOV_UB;
-    }
-    else if (x == CHIP8_I)
-    {
-        dstw  = SLJIT_OFFSETOF(chip8_t, i);
-        dstop = SLJIT_MOV_UH;
-    }
-    else
+    if (x > CHIP8_LAST_V_REG && x != CHIP8_I)
         goto invalid;
 
-    if (y < CHIP8_NUM_V_REGS)
-        srcw = SLJIT_OFFSETOF(chip8_t, v) + y;
-    else
+    if (y > CHIP8_LAST_V_REG)
         goto invalid;
 
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
-
-    if (x != CHIP8_I)
+    if (x != CHIP8_I && !dyn->vf_dead)
     {
         struct sljit_jump *set_zero;
         struct sljit_jump *keep_going;
 
-        // word R0 = (ubyte)S0->v[x]; word R1 = (ubyte)S0->v[y]
-        sljit_emit_op1(dyn->c, SLJIT_IMOV_UB, SLJIT_R0, 0, dst, dstw);
-        sljit_emit_op1(dyn->c, SLJIT_IMOV_UB, SLJIT_R1, 0, src, srcw);
-
-        // R0 = R0 + R1
-        sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+        // R0 = v[x] + v[y]
+        a = c8dyn_src_reg(dyn, x, SLJIT_R0);
+        b = c8dyn_src_reg(dyn, y, SLJIT_R1);
+        sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R0, 0, a, 0, b, 0);
 
-        // if (r0 <= 0xff) S0->v[15] = 0; else S0->v[15] = 1;
+        // if (r0 <= 0xff) v[15] = 0; else v[15] = 1;
         set_zero = sljit_emit_cmp(dyn->c, SLJIT_LESS_EQUAL, SLJIT_R0, 0, SLJIT_IMM, 0xff);
-        c8dyn_write_reg(dyn->c, CHIP8_VF, SLJIT_IMM, 1);
+        c8dyn_write_reg(dyn, CHIP8_VF, SLJIT_IMM, 1);
         keep_going = sljit_emit_jump(dyn->c, SLJIT_JUMP);
         sljit_set_label(set_zero, sljit_emit_label(dyn->c));
-        c8dyn_write_reg(dyn->c, CHIP8_VF, SLJIT_IMM, 0);
+        c8dyn_write_reg(dyn, CHIP8_VF, SLJIT_IMM, 0);
 
         sljit_set_label(keep_going, sljit_emit_label(dyn->c));
     }
 
-    // R0 = x's val; R1 = S0->v[y]; R0 = R0 + R1
-    sljit_emit_op1(dyn->c, dstop, SLJIT_R0, 0, dst, dstw);
-    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R1, 0, src, srcw);
-    sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    // R0 = x's val + v[y], either one may be vf
+    a = c8dyn_src_reg(dyn, x, SLJIT_R0);
+    b = c8dyn_src_reg(dyn, y, SLJIT_R1);
+    sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R0, 0, a, 0, b, 0);
 
     // *x = R0
-    sljit_emit_op1(dyn->c, dstop, dst, dstw, SLJIT_R0, 0);
+    c8dyn_write_reg(dyn, x, SLJIT_R0, 0);
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 
 invalid:
     fprintf(stderr, "add: invalid register combination %1x %1x\n", x, y);
     exit(1);
 }
 
-static c8dyn_op_t c8dyn_emit_bwop(chip8_t *c8, c8dyn_t *dyn, char type, uint8_t x, uint8_t y)
+static int c8dyn_emit_bwop(c8dyn_t *dyn, char type, uint8_t x, uint8_t y)
 {
-    sljit_si  src, srcw, dst, dstw, op;
-
-    src = dst = SLJIT_MEM1(SLJIT_S0);
-
-    if (x < CHIP8_NUM_V_REGS)
-        dstw = SLJIT_OFFSETOF(chip8_t, v) + x;
-    else
-        goto invalid;
+    sljit_si a, b, op;
 
-    if (y < CHIP8_NUM_V_REGS)
-        srcw = SLJIT_OFFSETOF(chip8_t, v) + y;
-    else
+    if (x > CHIP8_LAST_V_REG || y > CHIP8_LAST_V_REG)
         goto invalid;
 
     switch (type)
@@ -450,139 +950,129 @@ static c8dyn_op_t c8dyn_emit_bwop(chip8_t *c8, c8dyn_t *dyn, char type, uint8_t
         exit(1);
     }
 
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
-
     if (type == '>' || type == '<')
     {
-        sljit_emit_op1(dyn->c, SLJIT_IMOV_UB, SLJIT_R0, 0, dst, dstw);
+        if (!dyn->vf_dead)
+        {
+            a = c8dyn_src_reg(dyn, x, SLJIT_R0);
 
-        if (type == '>') // R1 = R0 & 1
-            sljit_emit_op2(dyn->c, SLJIT_AND, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 1);
-        else // R1 = R0 >> 7
-            sljit_emit_op2(dyn->c, SLJIT_LSHR, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 7);
+            if (type == '>') // R1 = R0 & 1
+                sljit_emit_op2(dyn->c, SLJIT_AND, SLJIT_R1, 0, a, 0, SLJIT_IMM, 1);
+            else // R1 = R0 >> 7
+                sljit_emit_op2(dyn->c, SLJIT_LSHR, SLJIT_R1, 0, a, 0, SLJIT_IMM, 7);
 
-        // vf = R1
-        c8dyn_write_reg(dyn->c, CHIP8_VF, SLJIT_R1, 0);
+            // vf = R1
+            c8dyn_write_reg(dyn, CHIP8_VF, SLJIT_R1, 0);
+        }
 
-        // R0 = R0 op 1
-        sljit_emit_op2(dyn->c, op, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 1);
+        // R0 = v[x] op 1, vx may be vf
+        a = c8dyn_src_reg(dyn, x, SLJIT_R0);
+        sljit_emit_op2(dyn->c, op, SLJIT_R0, 0, a, 0, SLJIT_IMM, 1);
     }
     else
     {
-        sljit_emit_op1(dyn->c, SLJIT_IMOV_UB, SLJIT_R0, 0, dst, dstw);
-        sljit_emit_op1(dyn->c, SLJIT_IMOV_UB, SLJIT_R1, 0, src, srcw);
-        sljit_emit_op2(dyn->c, op, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+        a = c8dyn_src_reg(dyn, x, SLJIT_R0);
+        b = c8dyn_src_reg(dyn, y, SLJIT_R1);
+        sljit_emit_op2(dyn->c, op, SLJIT_R0, 0, a, 0, b, 0);
     }
 
-    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, dst, dstw, SLJIT_R0, 0);
+    c8dyn_write_reg(dyn, x, SLJIT_R0, 0);
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 
 invalid:
     fprintf(stderr, "bwop (%c): invalid register combination %1x %1x\n", type, x, y);
     exit(1);
 }
 
-static c8dyn_op_t c8dyn_emit_sub(chip8_t *c8, c8dyn_t *dyn, bool swap_x_y, uint8_t x, uint8_t y)
+static int c8dyn_emit_sub(c8dyn_t *dyn, bool swap_x_y, uint8_t x, uint8_t y)
 {
-    sljit_si  src, srcw, dst, dstw;
+    sljit_si a, b;
 
-    src = dst = SLJIT_MEM1(SLJIT_S0);
-
-    if (x < CHIP8_NUM_V_REGS)
-        dstw  = SLJIT_OFFSETOF(chip8_t, v) + x;
-    else
+    if (x > CHIP8_LAST_V_REG || y > CHIP8_LAST_V_REG)
         goto invalid;
 
-    if (y < CHIP8_NUM_V_REGS)
-        srcw = SLJIT_OFFSETOF(chip8_t, v) + y;
-    else
-        goto invalid;
+    if (!dyn->vf_dead)
+    {
+        struct sljit_jump *set_zero;
+        struct sljit_jump *keep_going;
 
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
+        // a = v[x]; b = v[y]
+        a = c8dyn_src_reg(dyn, x, SLJIT_R0);
+        b = c8dyn_src_reg(dyn, y, SLJIT_R1);
+
+        // sub: if (a < b) v[15] = 0; else v[15] = 1;
+        // subn: if (b <= a) v[15] = 0; else v[15] = 1;
+        if (swap_x_y)
+            set_zero = sljit_emit_cmp(dyn->c, SLJIT_LESS_EQUAL, b, 0, a, 0);
+        else
+            set_zero = sljit_emit_cmp(dyn->c, SLJIT_LESS, a, 0, b, 0);
+        c8dyn_write_reg(dyn, CHIP8_VF, SLJIT_IMM, 1);
+        keep_going = sljit_emit_jump(dyn->c, SLJIT_JUMP);
+        sljit_set_label(set_zero, sljit_emit_label(dyn->c));
+        c8dyn_write_reg(dyn, CHIP8_VF, SLJIT_IMM, 0);
+        sljit_set_label(keep_going, sljit_emit_label(dyn->c));
+    }
 
-    struct sljit_jump *set_zero;
-    struct sljit_jump *keep_going;
+    // reload, either one may be vf
+    a = c8dyn_src_reg(dyn, x, SLJIT_R0);
+    b = c8dyn_src_reg(dyn, y, SLJIT_R1);
 
-    // R0 = S0->v[x]; R1 = S0->v[y]
+    // R0 = a - b or R0 = b - a
     if (swap_x_y)
-    {
-        sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R0, 0, src, srcw);
-        sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R1, 0, dst, dstw);
-    }
+        sljit_emit_op2(dyn->c, SLJIT_SUB, SLJIT_R0, 0, b, 0, a, 0);
     else
-    {
-        sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R0, 0, dst, dstw);
-        sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R1, 0, src, srcw);
-    }
-
-    // if (r0 < r1) S0->v[15] = 0; else S0->v[15] = 1;
-    set_zero = sljit_emit_cmp(dyn->c, SLJIT_LESS, SLJIT_R0, 0, SLJIT_R1, 0);
-    c8dyn_write_reg(dyn->c, CHIP8_VF, SLJIT_IMM, 1);
-    keep_going = sljit_emit_jump(dyn->c, SLJIT_JUMP);
-    sljit_set_label(set_zero, sljit_emit_label(dyn->c));
-    c8dyn_write_reg(dyn->c, CHIP8_VF, SLJIT_IMM, 0);
-    sljit_set_label(keep_going, sljit_emit_label(dyn->c));
-
-    // R0 = R0 - R1
-    sljit_emit_op2(dyn->c, SLJIT_SUB, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+        sljit_emit_op2(dyn->c, SLJIT_SUB, SLJIT_R0, 0, a, 0, b, 0);
 
     // *x = R0
-    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, dst, dstw, SLJIT_R0, 0);
-
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    c8dyn_write_reg(dyn, x, SLJIT_R0, 0);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 
 invalid:
     fprintf(stderr, "add: invalid register combination %1x %1x\n", x, y);
     exit(1);
 }
 
-static c8dyn_op_t c8dyn_emit_draw(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8_t y, uint8_t height)
+static int c8dyn_emit_draw(c8dyn_t *dyn, uint8_t x, uint8_t y, uint8_t height)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 3, 1, 0, 0, 0);
-
-    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-    // R1 = S0->v[x]; R2 = S0->v[x]; R1 = R1 << 8; R1 = R1 | R2;
-    c8dyn_read_reg(dyn->c, true, x, SLJIT_R1, 0);
-    c8dyn_read_reg(dyn->c, true, y, SLJIT_R2, 0);
+    // R1 = v[x]; R2 = v[y]; R1 = R1 << 8; R1 = R1 | R2;
+    c8dyn_read_reg(dyn, true, x, SLJIT_R1, 0);
+    c8dyn_read_reg(dyn, true, y, SLJIT_R2, 0);
     sljit_emit_op2(dyn->c, SLJIT_SHL, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 8);
     sljit_emit_op2(dyn->c , SLJIT_OR, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_R2, 0);
     // R2 = height
     sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R2, 0, SLJIT_IMM, height);
 
+    // c8_draw reads i and sets vf
+    c8dyn_spill(dyn, CHIP8_REG_BIT(CHIP8_I));
+
     // c8dyn_draw(r0, r1, r2);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
     sljit_emit_ijump(dyn->c, SLJIT_CALL3, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_draw));
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    c8dyn_reload(dyn, CHIP8_REG_BIT(CHIP8_VF));
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_END;
 }
 
-static c8dyn_op_t c8dyn_emit_load_f(chip8_t *c8, c8dyn_t *dyn, uint8_t x)
+static int c8dyn_emit_load_f(c8dyn_t *dyn, uint8_t x)
 {
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
-
-    // r0 = f
-    sljit_emit_op1(dyn->c, SLJIT_IMOV_UH, SLJIT_R0, 0, SLJIT_IMM, CHIP8_FONT_ADDR);
+    sljit_si a = c8dyn_src_reg(dyn, x, SLJIT_R1);
 
-    // r1 = s0->v[x] * 5
-    sljit_emit_op1(dyn->c, SLJIT_IMOV_UB, SLJIT_R1, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, v) + x);
-    sljit_emit_op2(dyn->c, SLJIT_IMUL, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 5);
+    // r1 = v[x] * 5
+    sljit_emit_op2(dyn->c, SLJIT_IMUL, SLJIT_R1, 0, a, 0, SLJIT_IMM, 5);
 
-    // r0 = (r0 + r1) & 0xfff
-    sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    // r0 = (f + r1) & 0xfff
+    sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R0, 0, SLJIT_R1, 0, SLJIT_IMM, CHIP8_FONT_ADDR);
     sljit_emit_op2(dyn->c, SLJIT_IAND, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xfff);
 
-    c8dyn_write_reg(dyn->c, CHIP8_I, SLJIT_R0, 0);
+    c8dyn_write_reg(dyn, CHIP8_I, SLJIT_R0, 0);
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_NEXT;
 }
 
-static c8dyn_op_t c8dyn_emit_cond_key(chip8_t *c8, c8dyn_t *dyn, bool equal, uint8_t x)
+static int c8dyn_emit_cond_key(c8dyn_t *dyn, uint16_t next, bool equal, uint8_t x)
 {
     if (x > CHIP8_LAST_V_REG)
     {
@@ -590,30 +1080,35 @@ static c8dyn_op_t c8dyn_emit_cond_key(chip8_t *c8, c8dyn_t *dyn, bool equal, uin
         exit(1);
     }
 
-    struct sljit_jump *dont_skip;
+    struct sljit_jump *skip, *no_events, *done;
 
-    // because of early return, equal == SLJIT_NOT_EQUAL, !equal == SLJIT_EQUAL
+    // skp skips on a pressed key, sknp on a released one
     sljit_si type = (equal ? SLJIT_NOT_EQUAL : SLJIT_EQUAL);
 
-    sljit_emit_enter(dyn->c, 0, 1, 1, 1, 0, 0, 0);
-
-    // R0 = S0->v[x]; R0 += offsetof(chip8_t, kbd); R0 = ((uint8_t*)S0)[R0];
-    c8dyn_read_reg(dyn->c, true, x, SLJIT_R0, 0);
+    // if (S0->keyq_head != S0->keyq_tail) R0 = c8dyn_test_key(S0, S0->v[x]);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, keyq_head));
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R1, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, keyq_tail));
+    no_events = sljit_emit_cmp(dyn->c, SLJIT_EQUAL, SLJIT_R0, 0, SLJIT_R1, 0);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
+    c8dyn_read_reg(dyn, true, x, SLJIT_R1, 0);
+    sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_test_key));
+    done = sljit_emit_jump(dyn->c, SLJIT_JUMP);
+
+    // else R0 = S0->v[x] & 0xf; R0 += offsetof(chip8_t, kbd); R0 = ((uint8_t*)S0)[R0];
+    sljit_set_label(no_events, sljit_emit_label(dyn->c));
+    c8dyn_read_reg(dyn, true, x, SLJIT_R0, 0);
+    sljit_emit_op2(dyn->c, SLJIT_AND, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xf);
     sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R0, 0, SLJIT_IMM, SLJIT_OFFSETOF(chip8_t, kbd), SLJIT_R0, 0);
     sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R0, 0, SLJIT_MEM2(SLJIT_S0, SLJIT_R0), 0);
+    sljit_set_label(done, sljit_emit_label(dyn->c));
 
-    dont_skip = sljit_emit_cmp(dyn->c, type, SLJIT_R0, 0, SLJIT_IMM, 1);
-    c8dyn_read_reg(dyn->c, true, CHIP8_PC, SLJIT_R0, 0);
-    sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 2);
-    c8dyn_write_reg(dyn->c, CHIP8_PC, SLJIT_R0, 0);
+    skip = sljit_emit_cmp(dyn->c, type, SLJIT_R0, 0, SLJIT_IMM, 0);
+    c8dyn_emit_skip(dyn, skip, next);
 
-    sljit_set_label(dont_skip, sljit_emit_label(dyn->c));
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_EXIT;
 }
 
-static c8dyn_op_t c8dyn_emit_wait_key(chip8_t *c8, c8dyn_t *dyn, uint8_t x)
+static int c8dyn_emit_wait_key(c8dyn_t *dyn, uint16_t next, uint8_t x)
 {
     if (x > CHIP8_LAST_V_REG)
     {
@@ -621,18 +1116,56 @@ static c8dyn_op_t c8dyn_emit_wait_key(chip8_t *c8, c8dyn_t *dyn, uint8_t x)
         exit(1);
     }
 
-    sljit_emit_enter(dyn->c, 0, 1, 1, 1, 0, 0, 0);
+    // c8_wait_key rewinds pc while no key is pressed
+    c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, next);
 
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
     sljit_emit_ijump(dyn->c, SLJIT_CALL1, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_wait_key));
-    c8dyn_write_reg(dyn->c, x, SLJIT_R0, 0);
+    c8dyn_write_reg(dyn, x, SLJIT_R0, 0);
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    return C8DYN_EXIT;
+}
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+/* calls c8dyn_invalidate for the len bytes a store writes from i, if the code bitmap has any of them */
+static void c8dyn_emit_store_check(c8dyn_t *dyn, unsigned len)
+{
+    const sljit_sw code = SLJIT_OFFSETOF(chip8_t, code);
+    struct sljit_jump *wraps, *misses;
+
+    // R0 = S0->i & 0xfff; if (R0 > 0x1000 - len) goto hit;
+    c8dyn_read_reg(dyn, true, CHIP8_I, SLJIT_R0, 0);
+    sljit_emit_op2(dyn->c, SLJIT_AND, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 0xfff);
+    wraps = sljit_emit_cmp(dyn->c, SLJIT_GREATER, SLJIT_R0, 0, SLJIT_IMM, 0x1000 - len);
+
+    // R1 = S0 + (R0 >> 5) * 4; R2 = code[0] >> (R0 & 31); R1 = code[1] << 1 << (31 - (R0 & 31));
+    sljit_emit_op2(dyn->c, SLJIT_LSHR, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 5);
+    sljit_emit_op2(dyn->c, SLJIT_SHL, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 2);
+    sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_S0, 0);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R2, 0, SLJIT_MEM1(SLJIT_R1), code);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R1, 0, SLJIT_MEM1(SLJIT_R1), code + 4);
+    sljit_emit_op2(dyn->c, SLJIT_AND, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 31);
+    sljit_emit_op2(dyn->c, SLJIT_LSHR, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R0, 0);
+    sljit_emit_op2(dyn->c, SLJIT_SHL, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_IMM, 1);
+    sljit_emit_op2(dyn->c, SLJIT_XOR, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 31);
+    sljit_emit_op2(dyn->c, SLJIT_SHL, SLJIT_R1, 0, SLJIT_R1, 0, SLJIT_R0, 0);
+
+    // if (!((R2 | R1) & mask)) goto done;
+    sljit_emit_op2(dyn->c, SLJIT_OR, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_R1, 0);
+    sljit_emit_op2(dyn->c, SLJIT_AND, SLJIT_R2, 0, SLJIT_R2, 0, SLJIT_IMM, (1u << len) - 1);
+    misses = sljit_emit_cmp(dyn->c, SLJIT_EQUAL, SLJIT_R2, 0, SLJIT_IMM, 0);
+
+    // hit: R0 = S0; R1 = S0->i; R2 = R1 + len - 1; c8dyn_invalidate(R0, R1, R2)
+    sljit_set_label(wraps, sljit_emit_label(dyn->c));
+    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
+    c8dyn_read_reg(dyn, true, CHIP8_I, SLJIT_R1, 0);
+    sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R2, 0, SLJIT_R1, 0, SLJIT_IMM, len - 1);
+    sljit_emit_ijump(dyn->c, SLJIT_CALL3, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_invalidate));
+
+    // done:
+    sljit_set_label(misses, sljit_emit_label(dyn->c));
 }
 
-static c8dyn_op_t c8dyn_emit_load_bcd(chip8_t *c8, c8dyn_t *dyn, uint8_t x)
+static int c8dyn_emit_load_bcd(c8dyn_t *dyn, uint8_t x)
 {
     if (x > CHIP8_LAST_V_REG)
     {
@@ -640,56 +1173,47 @@ static c8dyn_op_t c8dyn_emit_load_bcd(chip8_t *c8, c8dyn_t *dyn, uint8_t x)
         exit(1);
     }
 
-    sljit_emit_enter(dyn->c, 0, 1, 3, 1, 0, 0, 0);
+    c8dyn_emit_store_check(dyn, 3);
 
-    // R0 = S0;
-    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-    // R1 = S0->i; R2 = R1 + 2; c8dyn_invalidate(R0, R1, R2)
-    c8dyn_read_reg(dyn->c, true, CHIP8_I, SLJIT_R1, 0);
-    sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_R2, 0, SLJIT_R1, 0, SLJIT_IMM, 2);
-    sljit_emit_ijump(dyn->c, SLJIT_CALL3, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_invalidate));
+    // c8_load_bcd reads i
+    c8dyn_spill(dyn, CHIP8_REG_BIT(CHIP8_I));
 
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-    c8dyn_read_reg(dyn->c, false, x, SLJIT_R1, 0);
+    c8dyn_read_reg(dyn, false, x, SLJIT_R1, 0);
     sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_load_bcd));
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
-
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    // the store may have hit the code we are running
+    return C8DYN_END;
 }
 
-static c8dyn_op_t c8dyn_emit_load_ram(chip8_t *c8, c8dyn_t *dyn, bool from_ram, uint8_t x)
+static int c8dyn_emit_load_ram(c8dyn_t *dyn, bool from_ram, uint8_t x)
 {
+    // v0 to vx and i
+    uint32_t regs = (CHIP8_REG_BIT(x + 1) - 1) | CHIP8_REG_BIT(CHIP8_I);
+
     if (x > CHIP8_LAST_V_REG)
     {
         fprintf(stderr, "load_ram: invalid register %1x\n", x);
         exit(1);
     }
 
-    sljit_emit_enter(dyn->c, 0, 1, 3, 1, 0, 0, 0);
-
     if (!from_ram)
-    {
-        // R0 = S0;
-        sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-        // R1 = S0->i; R2 = R1 + 2
-        c8dyn_read_reg(dyn->c, true, CHIP8_I, SLJIT_R1, 0);
-        sljit_emit_op2(dyn->c, SLJIT_ADD, SLJIT_R2, 0, SLJIT_R1, 0, SLJIT_IMM, x);
+        c8dyn_emit_store_check(dyn, x + 1);
 
-        sljit_emit_ijump(dyn->c, SLJIT_CALL3, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_invalidate));
-    }
+    // c8_load_ram works on chip8_t
+    c8dyn_spill(dyn, regs);
 
     sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
     sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R1, 0, SLJIT_IMM, from_ram);
     sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R2, 0, SLJIT_IMM, x);
     sljit_emit_ijump(dyn->c, SLJIT_CALL3, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_load_ram));
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+    c8dyn_reload(dyn, from_ram ? regs : CHIP8_REG_BIT(CHIP8_I));
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return from_ram ? C8DYN_NEXT : C8DYN_END;
 }
 
-static c8dyn_op_t c8dyn_emit_rnd(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8_t kk)
+static int c8dyn_emit_rnd(c8dyn_t *dyn, uint8_t x, uint8_t kk)
 {
     if (x > CHIP8_LAST_V_REG)
     {
@@ -697,173 +1221,549 @@ static c8dyn_op_t c8dyn_emit_rnd(chip8_t *c8, c8dyn_t *dyn, uint8_t x, uint8_t k
         exit(1);
     }
 
-    sljit_emit_enter(dyn->c, 0, 1, 2, 1, 0, 0, 0);
-
-    // S0->v[x] = c8dyn_rnd(c8, kk);
-    sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
-    sljit_emit_op1(dyn->c, SLJIT_MOV_UB, SLJIT_R1, 0, SLJIT_IMM, kk);
-    sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_rnd));
-    c8dyn_write_reg(dyn->c, x, SLJIT_R0, 0);
+    // c8_rand inline: R0 = S0->rng; R0 ^= R0 << 13; R0 ^= R0 >> 17; R0 ^= R0 << 5; S0->rng = R0;
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, rng));
+    sljit_emit_op2(dyn->c, SLJIT_ISHL, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 13);
+    sljit_emit_op2(dyn->c, SLJIT_IXOR, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    sljit_emit_op2(dyn->c, SLJIT_ILSHR, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 17);
+    sljit_emit_op2(dyn->c, SLJIT_IXOR, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    sljit_emit_op2(dyn->c, SLJIT_ISHL, SLJIT_R1, 0, SLJIT_R0, 0, SLJIT_IMM, 5);
+    sljit_emit_op2(dyn->c, SLJIT_IXOR, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_R1, 0);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, rng), SLJIT_R0, 0);
+
+    // v[x] = (R0 >> 24) & kk;
+    sljit_emit_op2(dyn->c, SLJIT_ILSHR, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, 24);
+    sljit_emit_op2(dyn->c, SLJIT_IAND, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, kk);
+    c8dyn_write_reg(dyn, x, SLJIT_R0, 0);
+
+    return C8DYN_NEXT;
+}
 
-    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+static int c8dyn_emit_illegal(c8dyn_t *dyn)
+{
+    sljit_emit_op2(dyn->c, SLJIT_IOR, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, state),
+                   SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, state), SLJIT_IMM, CHIP8_STATE_ILEGAL);
 
-    return (c8dyn_op_t)sljit_generate_code(dyn->c);
+    return C8DYN_END;
 }
 
-static c8dyn_op_t c8dyn_translate(chip8_t *c8)
+/* emits the instruction at next - 2 */
+static int c8dyn_emit_instr(c8dyn_t *dyn, uint16_t next, uint16_t instr)
 {
-    c8dyn_t   *dyn = (c8dyn_t*)c8->dyn;
-    c8dyn_op_t *fn = &dyn->cache[c8->pc];
-
-    const uint16_t instr = c8->ram[c8->pc] << 8 | c8->ram[c8->pc + 1];
     const uint8_t x    = (instr >> 8) & 0x0f;
     const uint8_t y    = (instr >> 4) & 0xf;
     const uint8_t kk   = instr & 0x00ff;
     const uint16_t nnn = instr & 0x0fff;
 
-    *fn = NULL;
-    dyn->c = sljit_create_compiler(NULL);
-
     switch (instr >> 12)
     {
     case 0x0: // these call host functions
         switch (nnn)
         {
         case 0x00e0: // cls
-            *fn = c8dyn_emit_cls(c8, dyn);
-            break;
+            return c8dyn_emit_cls(dyn);
         case 0x00ee: // ret
-            *fn = c8dyn_emit_ret(c8, dyn);
-            break;
+            return c8dyn_emit_ret(dyn);
         default: // sys addr
-            *fn = c8dyn_emit_jp_nnn(c8, dyn, nnn);
-            break;
+            return c8dyn_emit_jp_nnn(dyn, next, nnn);
         }
         break;
     case 0x1: // jp nnn
-        *fn = c8dyn_emit_jp_nnn(c8, dyn, nnn);
-        break;
+        return c8dyn_emit_jp_nnn(dyn, next, nnn);
     case 0x2: // call nnn
-        *fn = c8dyn_emit_call_nnn(c8, dyn, nnn);
-        break;
+        return c8dyn_emit_call_nnn(dyn, next, nnn);
     case 0x3: // se vx, kk
-        *fn = c8dyn_emit_cond_kk(c8, dyn, true, x, kk);
-        break;
+        return c8dyn_emit_cond_kk(dyn, next, true, x, kk);
     case 0x4: // sne vx, kk
-        *fn = c8dyn_emit_cond_kk(c8, dyn, false, x, kk);
-        break;
+        return c8dyn_emit_cond_kk(dyn, next, false, x, kk);
     case 0x5: // se vx, vy
-        *fn = c8dyn_emit_cond(c8, dyn, true, x, y);
-        break;
+        return c8dyn_emit_cond(dyn, next, true, x, y);
     case 0x6: // ld vx, kk
-        *fn = c8dyn_emit_load_imm(c8, dyn, x, kk);
-        break;
+        return c8dyn_emit_load_imm(dyn, x, kk);
     case 0x7: // add vx, kk
-        *fn = c8dyn_emit_add_imm(c8, dyn, x, kk);
-        break;
+        return c8dyn_emit_add_imm(dyn, x, kk);
     case 0x8: // op vx, vy
     {
         switch (instr & 0x000f)
         {
         case 0x0: // ld
-            *fn = c8dyn_emit_load(c8, dyn, x, y);
-            break;
+            return c8dyn_emit_load(dyn, x, y);
         case 0x1: // or
-            *fn = c8dyn_emit_bwop(c8, dyn, '|', x, y);
-            break;
+            return c8dyn_emit_bwop(dyn, '|', x, y);
         case 0x2: // and
-            *fn = c8dyn_emit_bwop(c8, dyn, '&', x, y);
-            break;
+            return c8dyn_emit_bwop(dyn, '&', x, y);
         case 0x3: // xor
-            *fn = c8dyn_emit_bwop(c8, dyn, '^', x, y);
-            break;
+            return c8dyn_emit_bwop(dyn, '^', x, y);
         case 0x4: // add
-            *fn = c8dyn_emit_add(c8, dyn, x, y);
-            break;
+            return c8dyn_emit_add(dyn, x, y);
         case 0x5: // sub
-            *fn = c8dyn_emit_sub(c8, dyn, false, x, y);
-            break;
+            return c8dyn_emit_sub(dyn, false, x, y);
         case 0x6: // shr
-            *fn = c8dyn_emit_bwop(c8, dyn, '>', x, x);
-            break;
+            return c8dyn_emit_bwop(dyn, '>', x, x);
         case 0x7: // subn
-            *fn = c8dyn_emit_sub(c8, dyn, true, x, y);
-            break;
+            return c8dyn_emit_sub(dyn, true, x, y);
         case 0xe: // shl
-            *fn = c8dyn_emit_bwop(c8, dyn, '<', x, x);
-            break;
+            return c8dyn_emit_bwop(dyn, '<', x, x);
         }
         break;
     }
     case 0x9: // sne vx, vy
-        *fn = c8dyn_emit_cond(c8, dyn, false, x, y);
-        break;
+        return c8dyn_emit_cond(dyn, next, false, x, y);
     case 0xa: // ld i, nnn
-        *fn = c8dyn_emit_load_imm(c8, dyn, CHIP8_I, nnn);
-        break;
+        return c8dyn_emit_load_imm(dyn, CHIP8_I, nnn);
     case 0xb: // jp v0, addr
-        *fn = c8dyn_emit_jp_disp(c8, dyn, nnn);
-        break;
+        return c8dyn_emit_jp_disp(dyn, next, nnn);
     case 0xc: // rnd vx, byte
-        *fn = c8dyn_emit_rnd(c8, dyn, x, kk);
-        break;
+        return c8dyn_emit_rnd(dyn, x, kk);
     case 0xd: // drw vx, vy, nibble
-        *fn = c8dyn_emit_draw(c8, dyn, x, y, instr & 0xf);
-        break;
+        return c8dyn_emit_draw(dyn, x, y, instr & 0xf);
     case 0xe: // op vx
         switch (instr & 0xff)
         {
         case 0x9e: // skp vx
-            *fn = c8dyn_emit_cond_key(c8, dyn, true, x);
-            break;
+            return c8dyn_emit_cond_key(dyn, next, true, x);
         case 0xa1: // sknp vx
-            *fn = c8dyn_emit_cond_key(c8, dyn, false, x);
-            break;
+            return c8dyn_emit_cond_key(dyn, next, false, x);
         }
         break;
     case 0xf: // op o1, o2
         switch (instr & 0xff)
         {
         case 0x07: // ld vx, dt
-            *fn = c8dyn_emit_load(c8, dyn, x, CHIP8_DT);
-            break;
+            return c8dyn_emit_load(dyn, x, CHIP8_DT);
         case 0x0a: // ld vx, key
-            *fn = c8dyn_emit_wait_key(c8, dyn, x);
-            break;
+            return c8dyn_emit_wait_key(dyn, next, x);
         case 0x15: // ld dt, vx
-            *fn = c8dyn_emit_load(c8, dyn, CHIP8_DT, x);
-            break;
+            return c8dyn_emit_load(dyn, CHIP8_DT, x);
         case 0x18: // ld st, vx
-            *fn = c8dyn_emit_load(c8, dyn, CHIP8_ST, x);
-            break;
+            return c8dyn_emit_load(dyn, CHIP8_ST, x);
         case 0x1e: // add i, vx
-            *fn = c8dyn_emit_add(c8, dyn, CHIP8_I, x);
-            break;
+            return c8dyn_emit_add(dyn, CHIP8_I, x);
         case 0x29: // ld f, vx
-            *fn = c8dyn_emit_load_f(c8, dyn, x);
-            break;
+            return c8dyn_emit_load_f(dyn, x);
         case 0x33: // ld b, vx
-            *fn = c8dyn_emit_load_bcd(c8, dyn, x);
-            break;
+            return c8dyn_emit_load_bcd(dyn, x);
         case 0x55: // ld [i], vx
-            *fn = c8dyn_emit_load_ram(c8, dyn, false, x);
-            break;
+            return c8dyn_emit_load_ram(dyn, false, x);
         case 0x65: // ld vx, [i]
-            *fn = c8dyn_emit_load_ram(c8, dyn, true, x);
-            break;
+            return c8dyn_emit_load_ram(dyn, true, x);
         }
         break;
     }
 
-//    fprintf(stderr, "PC=%04x\n", c8->pc);
-//    dump_code(*fn, sljit_get_generated_code_size(dyn->c));
+    return c8dyn_emit_illegal(dyn);
+}
+
+/*
+ * Timers are only updated between blocks, so instructions touching them must
+ * start a block of their own to see the same values as the interpreters.
+ */
+static inline bool c8dyn_uses_timers(uint16_t instr)
+{
+    if ((instr & 0xf000) != 0xf000)
+        return false;
+
+    switch (instr & 0xff)
+    {
+    case 0x07: // ld vx, dt
+    case 0x15: // ld dt, vx
+    case 0x18: // ld st, vx
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Walks the block backwards and returns a mask of the instructions whose vf
+ * result is overwritten before being read. vf is live when the block exits.
+ */
+static uint32_t c8dyn_dead_flags(const uint16_t *instrs, unsigned count)
+{
+    const uint32_t vf = CHIP8_REG_BIT(CHIP8_VF);
+    uint32_t dead = 0;
+    bool live = true;
+
+    for (unsigned n = count; n-- > 0;)
+    {
+        uint32_t reads, writes;
+
+        c8_scan(instrs[n], &reads, &writes);
+
+        // only 8xyN writes vf as a flag, an operand being vf keeps it live
+        if ((instrs[n] & 0xf000) == 0x8000 && (writes & vf) && !(reads & vf) && !live)
+            dead |= 1u << n;
+
+        if (writes & vf)
+            live = false;
+
+        if (reads & vf)
+            live = true;
+    }
+
+    return dead;
+}
+
+/*
+ * Gives the registers used the most in the block a host register of their
+ * own, and loads the ones that are read before being written.
+ */
+static void c8dyn_alloc_regs(c8dyn_t *dyn, const uint16_t *instrs, unsigned count, uint32_t dead_flags)
+{
+    unsigned uses[CHIP8_I + 1] = { 0 };
+    uint32_t seen = 0, load = 0;
+
+    for (unsigned n = 0; n < count; ++n)
+    {
+        uint32_t reads, writes;
+
+        c8_scan(instrs[n], &reads, &writes);
+
+        if (dead_flags & (1u << n))
+            writes &= ~CHIP8_REG_BIT(CHIP8_VF);
+
+        for (uint8_t reg = 0; reg <= CHIP8_I; ++reg)
+            uses[reg] += !!(reads & CHIP8_REG_BIT(reg)) + !!(writes & CHIP8_REG_BIT(reg));
+
+        load |= reads & ~seen;
+        seen |= reads | writes;
+    }
+
+    dyn->cached = dyn->dirty = 0;
+
+    for (int host = 1; host < C8DYN_SAVEDS; ++host)
+    {
+        int best = -1;
+
+        // a register used only once is cheaper to leave in memory
+        for (uint8_t reg = 0; reg <= CHIP8_I; ++reg)
+        {
+            if (uses[reg] >= 2 && !(dyn->cached & CHIP8_REG_BIT(reg)) && (best < 0 || uses[reg] > uses[best]))
+                best = reg;
+        }
+
+        if (best < 0)
+            break;
+
+        dyn->host[best] = SLJIT_S(host);
+        dyn->cached    |= CHIP8_REG_BIT(best);
+    }
+
+    c8dyn_reload(dyn, load);
+}
+
+/*
+ * Compiles the block at start into out, leaving the cache alone. Only touches
+ * the registers of the block being translated, so it can run on the compiler
+ * thread while the instance goes on.
+ */
+static c8dyn_op_t c8dyn_compile(c8dyn_t *dyn, const uint8_t *ram, uint16_t start, c8dyn_block_t *out, sljit_uw *size)
+{
+    struct sljit_jump  *too_long, *out_of_cycles, *link = NULL;
+    struct sljit_label *body, *ret;
+
+    uint16_t instrs[C8DYN_MAX_BLOCK];
+    uint16_t addr = start;
+    unsigned count = 0;
+    uint32_t dead_flags;
+    int      exit = C8DYN_NEXT;
+    bool     end  = false;
+    uint16_t idle = C8DYN_NO_LINK;
+
+    // find where the block ends
+    do
+    {
+        const uint16_t instr = ram[addr] << 8 | ram[(addr + 1) & 0xfff];
+        uint32_t reads, writes;
+
+        if (count && c8dyn_uses_timers(instr))
+            break;
+
+        addr += 2;
+        instrs[count++] = instr;
+
+        end = c8_scan(instr, &reads, &writes);
+    }
+    while (!end && count < C8DYN_MAX_BLOCK && addr < 0xfff);
+
+    // blocks closing a loop that may be idle, or waiting for a key
+    if ((instrs[count - 1] >> 12) == 0x1 && c8_idle_candidate(ram, instrs[count - 1] & 0xfff, addr - 2))
+        idle = instrs[count - 1] & 0xfff;
+    else if ((instrs[count - 1] & 0xf0ff) == 0xf00a)
+        idle = addr - 2;
+
+    dyn->target = C8DYN_NO_LINK;
+    dyn->c = sljit_create_compiler(NULL);
+
+    sljit_emit_enter(dyn->c, 0, 1, 3, C8DYN_SAVEDS, 0, 0, 0);
+    body = sljit_emit_label(dyn->c);
+
+    // R0 = S0->cycles; if (R0 < count) return;
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, cycles));
+    too_long = sljit_emit_cmp(dyn->c, SLJIT_LESS, SLJIT_R0, 0, SLJIT_IMM, count);
+
+    dead_flags = c8dyn_dead_flags(instrs, count);
+    c8dyn_alloc_regs(dyn, instrs, count, dead_flags);
+
+    for (unsigned n = 0; n < count; ++n)
+    {
+        dyn->vf_dead = dead_flags & (1u << n);
+        exit = c8dyn_emit_instr(dyn, start + (n + 1) * 2, instrs[n]);
+    }
+
+    if (exit != C8DYN_EXIT)
+        c8dyn_write_reg(dyn, CHIP8_PC, SLJIT_IMM, addr);
+
+    c8dyn_spill(dyn, C8DYN_ALL_REGS);
+
+    // R0 = S0->cycles - count; S0->cycles = R0;
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, cycles));
+    sljit_emit_op2(dyn->c, SLJIT_ISUB, SLJIT_R0, 0, SLJIT_R0, 0, SLJIT_IMM, count);
+    sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, cycles), SLJIT_R0, 0);
+
+    // S0->run_time += count
+    sljit_emit_op2(dyn->c, SLJIT_IADD, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, run_time),
+                   SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, run_time), SLJIT_IMM, count);
+
+    // c8dyn_idle_skip(S0, idle); R0 = S0->cycles;
+    if (idle != C8DYN_NO_LINK)
+    {
+        sljit_emit_op1(dyn->c, SLJIT_MOV_P, SLJIT_R0, 0, SLJIT_S0, 0);
+        sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R1, 0, SLJIT_IMM, idle);
+        sljit_emit_ijump(dyn->c, SLJIT_CALL2, SLJIT_IMM, SLJIT_FUNC_OFFSET(c8dyn_idle_skip));
+        sljit_emit_op1(dyn->c, SLJIT_MOV_UI, SLJIT_R0, 0, SLJIT_MEM1(SLJIT_S0), SLJIT_OFFSETOF(chip8_t, cycles));
+    }
+
+    // if (R0) goto target; return;
+    if (dyn->target != C8DYN_NO_LINK)
+    {
+        out_of_cycles = sljit_emit_cmp(dyn->c, SLJIT_EQUAL, SLJIT_R0, 0, SLJIT_IMM, 0);
+        link = sljit_emit_jump(dyn->c, SLJIT_JUMP | SLJIT_REWRITABLE_JUMP);
+        sljit_set_label(out_of_cycles, sljit_emit_label(dyn->c));
+    }
+
+    ret = sljit_emit_label(dyn->c);
+    sljit_emit_return(dyn->c, SLJIT_UNUSED, 0, 0);
+
+    sljit_set_label(too_long, ret);
+
+    if (link)
+        sljit_set_label(link, ret);
+
+    c8dyn_compiling = dyn;
+    out->fn         = (c8dyn_op_t)sljit_generate_code(dyn->c);
+    c8dyn_compiling = NULL;
+
+    out->end    = addr;
+    out->target = C8DYN_NO_LINK;
+
+    if (out->fn)
+    {
+        out->body = sljit_get_label_addr(body);
+        *size     = sljit_get_generated_code_size(dyn->c);
+
+        if (link)
+        {
+            out->target   = dyn->target;
+            out->link     = sljit_get_jump_addr(link);
+            out->unlinked = sljit_get_label_addr(ret);
+        }
+    }
+
+//    fprintf(stderr, "PC=%04x\n", start);
+//    dump_code(out->fn, sljit_get_generated_code_size(dyn->c));
 
-    if (!*fn)
+    if (!out->fn)
         fprintf(stderr, "Compiler error: %i\n", sljit_get_compiler_error(dyn->c));
 
     sljit_free_compiler(dyn->c);
 
-    return *fn;
+    return out->fn;
+}
+
+/* puts a compiled block in the cache, chaining it */
+static void c8dyn_install(chip8_t *c8, uint16_t start, const c8dyn_block_t *code)
+{
+    c8dyn_t       *dyn   = (c8dyn_t*)c8->dyn;
+    c8dyn_block_t *block = &dyn->cache[start];
+
+    // the links into the address stay
+    block->fn       = code->fn;
+    block->body     = code->body;
+    block->end      = code->end;
+    block->target   = code->target;
+    block->link     = code->link;
+    block->unlinked = code->unlinked;
+
+    dyn->nblocks++;
+    dyn->stats.translations++;
+    if (dyn->seen[start / 32] & (1u << (start % 32)))
+        dyn->stats.retranslations++;
+    dyn->seen[start / 32] |= 1u << (start % 32);
+
+    c8_code_mark(c8, start, code->end - start);
+    c8dyn_link(dyn, start);
+}
+
+static c8dyn_op_t c8dyn_translate(chip8_t *c8)
+{
+    const uint16_t start = c8->pc & 0xfff;
+    c8dyn_block_t  code;
+    sljit_uw       size;
+
+    if (c8dyn_compile((c8dyn_t*)c8->dyn, c8->ram, start, &code, &size))
+        c8dyn_install(c8, start, &code);
+
+    return code.fn;
+}
+
+static void *c8dyn_work(void *data)
+{
+    (void)data;
+
+    pthread_mutex_lock(&c8dyn_worker.lock);
+
+    while (1)
+    {
+        c8dyn_job_t *job;
+
+        while (!c8dyn_worker.head)
+            pthread_cond_wait(&c8dyn_worker.queued, &c8dyn_worker.lock);
+
+        job = c8dyn_worker.head;
+        c8dyn_worker.head = job->next;
+        __atomic_store_n(&job->state, C8DYN_JOB_RUNNING, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&c8dyn_worker.lock);
+
+        c8dyn_reserved = job->code;
+        c8dyn_compile(job->dyn, job->ram, job->start, &job->block, &job->size);
+        c8dyn_reserved = NULL;
+
+        // the code is written by the time the instance sees it done
+        pthread_mutex_lock(&c8dyn_worker.lock);
+        __atomic_store_n(&job->state, C8DYN_JOB_DONE, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&c8dyn_worker.done);
+    }
+
+    return NULL;
+}
+
+/*
+ * Queues the block at start for the compiler thread, one per instance at a
+ * time. Its code goes on a cache line of its own so writing it never touches
+ * a line the instance is running. Returns false if there was no room for it.
+ */
+static bool c8dyn_submit(chip8_t *c8, uint16_t start)
+{
+    c8dyn_t     *dyn = (c8dyn_t*)c8->dyn;
+    c8dyn_job_t *job = &dyn->job;
+
+    if (!(job->code = c8dyn_alloc(dyn, C8DYN_JOB_CODE, C8DYN_LINE)))
+        return false;
+
+    job->next  = NULL;
+    job->dyn   = dyn;
+    job->state = C8DYN_JOB_QUEUED;
+    job->busy  = true;
+    job->start = start;
+    memcpy(job->ram, c8->ram, sizeof(job->ram));
+
+    pthread_mutex_lock(&c8dyn_worker.lock);
+
+    if (!c8dyn_worker.started)
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, c8dyn_work, NULL))
+        {
+            fprintf(stderr, "dyn: could not start the compiler thread\n");
+            exit(1);
+        }
+
+        pthread_detach(thread);
+        c8dyn_worker.started = true;
+    }
+
+    if (c8dyn_worker.head)
+        c8dyn_worker.tail->next = job;
+    else
+        c8dyn_worker.head = job;
+    c8dyn_worker.tail = job;
+
+    pthread_cond_signal(&c8dyn_worker.queued);
+    pthread_mutex_unlock(&c8dyn_worker.lock);
+
+    return true;
+}
+
+/* true once the job can be finished without waiting */
+static inline bool c8dyn_job_done(const c8dyn_t *dyn)
+{
+    return dyn->job.busy && __atomic_load_n(&dyn->job.state, __ATOMIC_ACQUIRE) == C8DYN_JOB_DONE;
+}
+
+/*
+ * Installs the block of a finished job, unless ram changed under it while it
+ * was compiled. Returns false if it was dropped.
+ */
+static bool c8dyn_finish(chip8_t *c8)
+{
+    c8dyn_t        *dyn    = (c8dyn_t*)c8->dyn;
+    c8dyn_job_t    *job    = &dyn->job;
+    c8dyn_region_t *region = c8dyn_region_of(job->code);
+    const uint16_t  start  = job->start;
+
+    job->busy = false;
+
+    if (!job->block.fn || memcmp(&c8->ram[start], &job->ram[start], job->block.end - start))
+    {
+        c8dyn_exec_free(job->code);
+        return false;
+    }
+
+    // nothing else was allocated meanwhile, the space the block didn't use goes back
+    if ((uint8_t*)region + region->used == (uint8_t*)job->code + C8DYN_JOB_CODE)
+        region->used = (uint8_t*)job->code - (uint8_t*)region + ((job->size + C8DYN_CODE_ALIGN - 1) & ~(sljit_uw)(C8DYN_CODE_ALIGN - 1));
+
+    c8dyn_install(c8, start, &job->block);
+    return true;
+}
+
+/* waits for the compiler thread to be done with the job, if any, and drops it */
+static void c8dyn_cancel(c8dyn_t *dyn)
+{
+    c8dyn_job_t *job = &dyn->job;
+
+    if (!job->busy)
+        return;
+
+    pthread_mutex_lock(&c8dyn_worker.lock);
+
+    if (job->state == C8DYN_JOB_QUEUED)
+    {
+        c8dyn_job_t *prev = NULL, *i = c8dyn_worker.head;
+
+        for (; i != job; i = i->next)
+            prev = i;
+
+        if (prev)
+            prev->next = job->next;
+        else
+            c8dyn_worker.head = job->next;
+
+        if (c8dyn_worker.tail == job)
+            c8dyn_worker.tail = prev;
+    }
+    else
+    {
+        while (job->state != C8DYN_JOB_DONE)
+            pthread_cond_wait(&c8dyn_worker.done, &c8dyn_worker.lock);
+    }
+
+    pthread_mutex_unlock(&c8dyn_worker.lock);
+
+    job->busy = false;
+    c8dyn_exec_free(job->code);
 }
 
 
@@ -872,12 +1772,15 @@ static void c8_dyn_step(chip8_t *c8)
     c8dyn_t *dyn = (c8dyn_t*)c8->dyn;
     while (c8->cycles)
     {
-        c8dyn_op_t fn = dyn->cache[c8->pc];
+        c8dyn_op_t fn;
+
+        c8->pc &= 0xfff;
+        fn = c8dyn_lookup(dyn, c8->pc);
 
         if (!fn)
             fn = c8dyn_translate(c8);
-
-        c8->pc += 2;
+        else if (fn == dyn->cache[c8->pc].fn)
+            c8dyn_region_of((void*)fn)->entered = true;
 
         if (!fn)
         {
@@ -885,38 +1788,178 @@ static void c8_dyn_step(chip8_t *c8)
             exit(1);
         }
 
+        // chained blocks only come back once cycles runs out, or is too short for the next one
+        const unsigned cycles = c8->cycles;
         fn(c8);
 
-        c8->run_time++;
-        c8->cycles--;
-
-        if ((c8->run_time % (CHIP8_CLOCK/60)) == 0)
+        // a block that didn't fit ran nothing, only its last instruction can jump or store
+        if (c8->cycles == cycles)
         {
-            if (c8->dt)
-                c8->dt--;
-
-            if (c8->st)
-                c8->st--;
+            while (c8->cycles)
+                c8_naive_step(c8);
         }
 
-        c8->poll(c8->kbd, c8->poll_data);
+        if (dyn->ndead || dyn->retired)
+            c8dyn_reap(dyn);
     }
 }
 
+/*
+ * sljit sets up its constants with the first compiler and looks up the cpu
+ * features with the first op that needs them, without any locking. clz is
+ * one of those, so a throwaway compiler emitting it does both before any
+ * thread translates.
+ */
+static void c8dyn_warm_up(void)
+{
+    struct sljit_compiler *c = sljit_create_compiler(NULL);
+
+    if (!c)
+    {
+        fprintf(stderr, "dyn: out of memory\n");
+        exit(1);
+    }
+
+    sljit_is_fpu_available();
+
+    sljit_emit_enter(c, 0, 1, 1, 1, 0, 0, 0);
+    sljit_emit_op1(c, SLJIT_CLZ, SLJIT_R0, 0, SLJIT_S0, 0);
+    sljit_free_compiler(c);
+}
+
 static void c8_dyn_new(chip8_t *c8)
 {
     c8dyn_t *dyn;
     c8->dyn = dyn = calloc(1, sizeof(*dyn));
 
+    if (!dyn)
+    {
+        fprintf(stderr, "dyn: out of memory\n");
+        exit(1);
+    }
+
+    dyn->refs = 1;
+    dyn->max_regions = C8DYN_MAX_REGIONS;
+    for (int i = 0; i < 4096; ++i)
+        dyn->cache[i].target = dyn->cache[i].links = C8DYN_NO_LINK;
 
-    c8dyn_invalidate(c8, 0, 4096);
+    pthread_once(&c8dyn_warmed_up, c8dyn_warm_up);
 }
 
-static void c8_dyn_free(chip8_t *c8)
+/* drops every block at once, their code with the regions */
+static void c8_dyn_reset(chip8_t *c8)
+{
+    c8dyn_t *dyn = (c8dyn_t*)c8->dyn;
+
+    c8dyn_cancel(dyn);
+
+    dyn->ndead = 0;
+    c8dyn_trim_regions(dyn);
+
+    for (int i = 0; i < 4096; ++i)
+    {
+        dyn->cache[i].fn     = NULL;
+        dyn->cache[i].target = dyn->cache[i].links = C8DYN_NO_LINK;
+    }
+
+    dyn->nblocks = 0;
+    memset(dyn->seen, 0, sizeof(dyn->seen));
+    memset(dyn->heat, 0, sizeof(dyn->heat));
+    memset(dyn->strikes, 0, sizeof(dyn->strikes));
+    memset(c8->code, 0, sizeof(c8->code));
+
+    c8dyn_release(dyn->retired);
+    dyn->retired = NULL;
+
+    c8dyn_release(dyn->base);
+    dyn->base = NULL;
+}
+
+/* the blocks of c8 become a base of both, if it has any. clone->dyn is NULL or empty */
+static void c8_dyn_clone(chip8_t *clone, chip8_t *c8)
+{
+    c8dyn_t *dyn  = (c8dyn_t*)c8->dyn;
+    c8dyn_t *base = dyn->base;
+    c8dyn_t *top;
+
+    if (dyn->nblocks)
+    {
+        // a frozen set can't take the block
+        c8dyn_cancel(dyn);
+
+        base = dyn;
+        c8_dyn_new(c8);
+
+        top = (c8dyn_t*)c8->dyn;
+        top->base        = base;
+        top->max_regions = base->max_regions;
+        top->stats       = base->stats;
+        memcpy(top->seen, base->seen, sizeof(top->seen));
+    }
+
+    if (!clone->dyn)
+        c8_dyn_new(clone);
+
+    // the clone only takes the budget, it counts from scratch
+    top = (c8dyn_t*)clone->dyn;
+    top->base        = base;
+    top->max_regions = dyn->max_regions;
+
+    if (base)
+        __atomic_add_fetch(&base->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* budget in whole regions, at least one. Must not be called while running */
+static void c8_dyn_set_budget(chip8_t *c8, size_t bytes)
 {
     c8dyn_t *dyn = (c8dyn_t*)c8->dyn;
 
-    c8dyn_invalidate(c8, 0, 4096);
+    // eviction could take the space of the job
+    c8dyn_cancel(dyn);
+
+    dyn->max_regions = bytes ? bytes / C8DYN_REGION_SIZE : C8DYN_MAX_REGIONS;
+    if (!dyn->max_regions)
+        dyn->max_regions = 1;
+
+    if (dyn->spare && dyn->nregions >= dyn->max_regions)
+    {
+        munmap(dyn->spare, C8DYN_REGION_SIZE);
+        dyn->spare = NULL;
+    }
+
+    while (dyn->nregions > dyn->max_regions)
+    {
+        c8dyn_region_t *region = c8dyn_clock(dyn);
+
+        c8dyn_evict(dyn, region);
+        munmap(region, C8DYN_REGION_SIZE);
+        dyn->nregions--;
+    }
+}
+
+static void c8_dyn_stats(const chip8_t *c8, chip8_code_stats_t *stats)
+{
+    const c8dyn_t *dyn = (const c8dyn_t*)c8->dyn;
+
+    *stats = dyn->stats;
+    stats->code_bytes = (size_t)(dyn->nregions + (dyn->spare ? 1 : 0)) * C8DYN_REGION_SIZE;
+    stats->blocks     = dyn->nblocks;
+}
+
+/* back to the budget and counters of a new instance, for pooled ones */
+static void c8_dyn_recycle(chip8_t *c8)
+{
+    c8dyn_t *dyn = (c8dyn_t*)c8->dyn;
+
+    c8_dyn_reset(c8);
+    memset(&dyn->stats, 0, sizeof(dyn->stats));
+    c8_dyn_set_budget(c8, 0);
+}
+
+static void c8_dyn_free(chip8_t *c8)
+{
+    c8_dyn_reset(c8);
 
+    c8dyn_release((c8dyn_t*)c8->dyn);
     c8->dyn = NULL;
 }
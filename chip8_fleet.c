@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "chip8_fleet.h"
+
+/*
+ * Each worker owns a deque of instance indices. It pops from the bottom of its
+ * own and, once that runs dry, steals from the top of the others. A task runs
+ * one instance for all the frames of the round, instances never share a
+ * thread within a round.
+ */
+
+typedef struct {
+    pthread_t        thread;
+    chip8_fleet_t   *fleet;
+    unsigned         id;
+
+    pthread_mutex_t  lock;
+    size_t          *tasks;
+    size_t           top, bottom;
+} c8fleet_worker_t;
+
+struct chip8_fleet {
+    chip8_t        **vms;
+    size_t           count, size;
+
+    c8fleet_worker_t *workers;
+    unsigned          nworkers;
+    size_t            ntasks; /* capacity of each deque */
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   start, done;
+    unsigned         round;
+    unsigned         frames;
+    size_t           pending; /* tasks not finished yet */
+    unsigned         active;  /* workers inside the round */
+    bool             quit;
+};
+
+static void *c8fleet_alloc(size_t size)
+{
+    void *ptr = calloc(1, size);
+
+    if (!ptr)
+    {
+        fprintf(stderr, "fleet: out of memory\n");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+static bool c8fleet_pop(c8fleet_worker_t *w, size_t *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom > w->top)
+    {
+        *task = w->tasks[--w->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return found;
+}
+
+static bool c8fleet_steal(c8fleet_worker_t *w, size_t *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom > w->top)
+    {
+        *task = w->tasks[w->top++];
+        found = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return found;
+}
+
+static bool c8fleet_next(c8fleet_worker_t *w, size_t *task)
+{
+    chip8_fleet_t *fleet = w->fleet;
+
+    if (c8fleet_pop(w, task))
+        return true;
+
+    for (unsigned n = 1; n < fleet->nworkers; ++n)
+    {
+        if (c8fleet_steal(&fleet->workers[(w->id + n) % fleet->nworkers], task))
+            return true;
+    }
+
+    return false;
+}
+
+static void *c8fleet_work(void *data)
+{
+    c8fleet_worker_t *w     = (c8fleet_worker_t*)data;
+    chip8_fleet_t    *fleet = w->fleet;
+    unsigned          seen  = 0;
+
+    while (1)
+    {
+        unsigned frames;
+        size_t   task, done = 0;
+
+        pthread_mutex_lock(&fleet->lock);
+        while (fleet->round == seen && !fleet->quit)
+            pthread_cond_wait(&fleet->start, &fleet->lock);
+
+        if (fleet->quit)
+        {
+            pthread_mutex_unlock(&fleet->lock);
+            break;
+        }
+
+        seen   = fleet->round;
+        frames = fleet->frames;
+        fleet->active++;
+        pthread_mutex_unlock(&fleet->lock);
+
+        while (c8fleet_next(w, &task))
+        {
+            for (unsigned f = 0; f < frames; ++f)
+                c8_run(fleet->vms[task], 0);
+
+            done++;
+        }
+
+        pthread_mutex_lock(&fleet->lock);
+        fleet->pending -= done;
+        fleet->active--;
+        if (!fleet->active)
+            pthread_cond_signal(&fleet->done);
+        pthread_mutex_unlock(&fleet->lock);
+    }
+
+    return NULL;
+}
+
+chip8_fleet_t *c8_fleet_new(unsigned threads)
+{
+    chip8_fleet_t *fleet = (chip8_fleet_t*)c8fleet_alloc(sizeof(*fleet));
+
+    pthread_mutex_init(&fleet->lock, NULL);
+    pthread_cond_init(&fleet->start, NULL);
+    pthread_cond_init(&fleet->done, NULL);
+
+    fleet->nworkers = threads;
+    fleet->workers  = (c8fleet_worker_t*)c8fleet_alloc((threads ? threads : 1) * sizeof(c8fleet_worker_t));
+
+    for (unsigned n = 0; n < threads; ++n)
+    {
+        c8fleet_worker_t *w = &fleet->workers[n];
+
+        w->fleet = fleet;
+        w->id    = n;
+        pthread_mutex_init(&w->lock, NULL);
+
+        if (pthread_create(&w->thread, NULL, c8fleet_work, w))
+        {
+            fprintf(stderr, "fleet: could not start worker %u\n", n);
+            exit(1);
+        }
+    }
+
+    return fleet;
+}
+
+void c8_fleet_free(chip8_fleet_t *fleet)
+{
+    pthread_mutex_lock(&fleet->lock);
+    fleet->quit = true;
+    pthread_cond_broadcast(&fleet->start);
+    pthread_mutex_unlock(&fleet->lock);
+
+    for (unsigned n = 0; n < fleet->nworkers; ++n)
+    {
+        pthread_join(fleet->workers[n].thread, NULL);
+        pthread_mutex_destroy(&fleet->workers[n].lock);
+        free(fleet->workers[n].tasks);
+    }
+
+    for (size_t n = 0; n < fleet->count; ++n)
+        c8_free(fleet->vms[n]);
+
+    pthread_cond_destroy(&fleet->done);
+    pthread_cond_destroy(&fleet->start);
+    pthread_mutex_destroy(&fleet->lock);
+
+    free(fleet->workers);
+    free(fleet->vms);
+    free(fleet);
+}
+
+/* the new instance is reset, load a rom into it before running the fleet */
+chip8_t *c8_fleet_add(chip8_fleet_t *fleet)
+{
+    if (fleet->count == fleet->size)
+    {
+        fleet->size = fleet->size ? fleet->size * 2 : 16;
+        fleet->vms  = (chip8_t**)realloc(fleet->vms, fleet->size * sizeof(chip8_t*));
+
+        if (!fleet->vms)
+        {
+            fprintf(stderr, "fleet: out of memory\n");
+            exit(1);
+        }
+    }
+
+    return fleet->vms[fleet->count++] = c8_new();
+}
+
+size_t c8_fleet_size(const chip8_fleet_t *fleet)
+{
+    return fleet->count;
+}
+
+chip8_t *c8_fleet_get(chip8_fleet_t *fleet, size_t n)
+{
+    return n < fleet->count ? fleet->vms[n] : NULL;
+}
+
+/* runs every instance for the given number of frames, returns when all are done */
+void c8_fleet_run(chip8_fleet_t *fleet, unsigned frames)
+{
+    if (!fleet->nworkers)
+    {
+        for (size_t n = 0; n < fleet->count; ++n)
+        {
+            for (unsigned f = 0; f < frames; ++f)
+                c8_run(fleet->vms[n], 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&fleet->lock);
+
+    // a worker that woke up late for the last round may still be looking for work
+    while (fleet->active)
+        pthread_cond_wait(&fleet->done, &fleet->lock);
+
+    // every worker is idle here, so the deques can be refilled
+    if (fleet->ntasks < fleet->count)
+    {
+        fleet->ntasks = fleet->size;
+
+        for (unsigned n = 0; n < fleet->nworkers; ++n)
+        {
+            c8fleet_worker_t *w = &fleet->workers[n];
+
+            free(w->tasks);
+            w->tasks = (size_t*)c8fleet_alloc(fleet->ntasks * sizeof(size_t));
+        }
+    }
+
+    for (unsigned n = 0; n < fleet->nworkers; ++n)
+    {
+        c8fleet_worker_t *w = &fleet->workers[n];
+
+        pthread_mutex_lock(&w->lock);
+        w->top = w->bottom = 0;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    for (size_t n = 0; n < fleet->count; ++n)
+    {
+        c8fleet_worker_t *w = &fleet->workers[n % fleet->nworkers];
+
+        pthread_mutex_lock(&w->lock);
+        w->tasks[w->bottom++] = n;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    fleet->frames  = frames;
+    fleet->pending = fleet->count;
+    fleet->round++;
+    pthread_cond_broadcast(&fleet->start);
+
+    while (fleet->pending || fleet->active)
+        pthread_cond_wait(&fleet->done, &fleet->lock);
+
+    pthread_mutex_unlock(&fleet->lock);
+}
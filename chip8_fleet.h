@@ -0,0 +1,20 @@
+#ifndef CHIP8_FLEET_H
+#define CHIP8_FLEET_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+/*
+ * A set of independent instances stepped together by a fixed pool of worker
+ * threads. Instances are owned by the fleet and freed with it.
+ */
+typedef struct chip8_fleet chip8_fleet_t;
+
+chip8_fleet_t *c8_fleet_new(unsigned threads);
+void           c8_fleet_free(chip8_fleet_t *fleet);
+chip8_t       *c8_fleet_add(chip8_fleet_t *fleet);
+size_t         c8_fleet_size(const chip8_fleet_t *fleet);
+chip8_t       *c8_fleet_get(chip8_fleet_t *fleet, size_t n);
+void           c8_fleet_run(chip8_fleet_t *fleet, unsigned frames);
+
+#endif // CHIP8_FLEET_H
@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8_group.h"
+#include "chip8_naive.h"
+
+#if CHIP8_GROUP_LANES != 8 && CHIP8_GROUP_LANES != 16 && CHIP8_GROUP_LANES != 32
+#error "CHIP8_GROUP_LANES must be 8, 16 or 32"
+#endif
+
+/*
+ * Registers are kept as struct-of-arrays, one GCC vector per register with a
+ * lane per instance, so the compiler maps them to SSE/AVX registers. Every
+ * cycle the instruction at the leading lane's pc runs for all the lanes at
+ * that pc. The ALU, immediate, skip, jump and timer instructions run as
+ * masked vector operations, anything else is copied back to the chip8_t and
+ * stepped with c8_naive_step. Lanes that end up at another pc leave the
+ * vectors and step on their own until they reach the leader's pc again.
+ */
+
+#define C8G_LANES CHIP8_GROUP_LANES
+
+typedef uint8_t  c8g_u8  __attribute__((vector_size(C8G_LANES)));
+typedef uint16_t c8g_u16 __attribute__((vector_size(C8G_LANES * 2)));
+
+/* masks are all ones in the selected lanes */
+#define C8G_BLEND(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+struct chip8_group {
+    chip8_t *vms[C8G_LANES];
+    unsigned count;
+
+    /* lane n holds the registers of vms[n] */
+    c8g_u8  v[16];
+    c8g_u8  dt, st;
+    c8g_u16 pc, i;
+
+    c8g_u16  live;     /* lanes held in the vectors, the rest are in their chip8_t */
+    c8g_u8   live8;    /* same, for 8 bit registers */
+    uint32_t in;       /* same, a bit per lane */
+    uint32_t all;      /* lanes holding an instance */
+    unsigned run_time; /* shared by all the lanes */
+    uint16_t idle_miss; /* loop the lanes could not skip together since the last deadline */
+    bool     ram_same; /* all the lanes have the same ram contents */
+};
+
+/* 8 bit values to 16 bit ones */
+#define C8G_WIDEN(v) (__builtin_convertvector((v), c8g_u16))
+
+static void c8g_load_lane(chip8_group_t *group, unsigned n)
+{
+    const chip8_t *c8 = group->vms[n];
+
+    for (unsigned r = 0; r < 16; ++r)
+        group->v[r][n] = c8->v[r];
+
+    group->dt[n] = c8->dt;
+    group->st[n] = c8->st;
+    group->pc[n] = c8->pc;
+    group->i[n]  = c8->i;
+}
+
+static void c8g_store_lane(chip8_group_t *group, unsigned n)
+{
+    chip8_t *c8 = group->vms[n];
+
+    for (unsigned r = 0; r < 16; ++r)
+        c8->v[r] = group->v[r][n];
+
+    c8->dt       = group->dt[n];
+    c8->st       = group->st[n];
+    c8->pc       = group->pc[n];
+    c8->i        = group->i[n];
+    c8->run_time = group->run_time;
+}
+
+static bool c8g_ram_same(const chip8_group_t *group)
+{
+    for (unsigned n = 1; n < group->count; ++n)
+    {
+        if (memcmp(group->vms[0]->ram, group->vms[n]->ram, CHIP8_RAM_SIZE))
+            return false;
+    }
+
+    return true;
+}
+
+/* bytes written to ram at i by the instruction */
+static inline unsigned c8g_stores(uint16_t instr)
+{
+    if ((instr & 0xf0ff) == 0xf033)
+        return 3;
+
+    if ((instr & 0xf0ff) == 0xf055)
+        return ((instr >> 8) & 0xf) + 1;
+
+    return 0;
+}
+
+/* true if the lanes still agree on the bytes written at addr */
+static bool c8g_ram_same_at(const chip8_group_t *group, uint16_t addr, unsigned size)
+{
+    for (unsigned n = 1; n < group->count; ++n)
+    {
+        for (unsigned k = 0; k < size; ++k)
+        {
+            const uint16_t at = (addr + k) & 0xfff;
+
+            if (group->vms[n]->ram[at] != group->vms[0]->ram[at])
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Runs instr on the lanes in the vectors, their pc already points past it.
+ * Returns false if the instruction has no vector form, nothing is touched
+ * then.
+ */
+static bool c8g_exec(chip8_group_t *group, uint16_t instr)
+{
+    const c8g_u16  m16 = group->live;
+    const uint8_t  x   = (instr >> 8) & 0x0f;
+    const uint8_t  y   = (instr >> 4) & 0xf;
+    const uint8_t  kk  = instr & 0x00ff;
+    const uint16_t nnn = instr & 0x0fff;
+    const c8g_u8   m8  = group->live8;
+    const c8g_u8   one = m8 & 1;
+
+    c8g_u8 *v = group->v;
+    c8g_u8  taken;
+
+    switch (instr >> 12)
+    {
+    case 0x0: // sys addr jumps like jp, cls and ret don't vectorize
+        if (nnn == 0x0e0 || nnn == 0x0ee)
+            return false;
+        // fallthrough
+    case 0x1: // jp nnn
+    {
+        // all the lanes were at the same pc, flag them the way c8_jump does
+        const uint16_t pc    = group->pc[__builtin_ctz(group->in)] - 2;
+        const unsigned state = (nnn == pc ? CHIP8_STATE_HALT : 0) | (nnn < 0x200 ? CHIP8_STATE_ILEGAL : 0);
+
+        for (uint32_t lanes = state ? group->in : 0; lanes; lanes &= lanes - 1)
+            group->vms[__builtin_ctz(lanes)]->state |= state;
+
+        group->pc = C8G_BLEND(m16, (c8g_u16){} + nnn, group->pc);
+        return true;
+    }
+    case 0x3: // se vx, kk
+        taken = (c8g_u8)(v[x] == kk);
+        break;
+    case 0x4: // sne vx, kk
+        taken = (c8g_u8)(v[x] != kk);
+        break;
+    case 0x5: // se vx, vy
+        taken = (c8g_u8)(v[x] == v[y]);
+        break;
+    case 0x9: // sne vx, vy
+        taken = (c8g_u8)(v[x] != v[y]);
+        break;
+    case 0x6: // ld vx, kk
+        v[x] = C8G_BLEND(m8, (c8g_u8){} + kk, v[x]);
+        return true;
+    case 0x7: // add vx, kk
+        v[x] = C8G_BLEND(m8, v[x] + kk, v[x]);
+        return true;
+    case 0x8: // op vx, vy
+        // like c8_naive_step, vf is written first and the operands read again
+        switch (instr & 0xf)
+        {
+        case 0x0: // ld
+            v[x] = C8G_BLEND(m8, v[y], v[x]);
+            return true;
+        case 0x1: // or
+            v[x] = C8G_BLEND(m8, v[x] | v[y], v[x]);
+            return true;
+        case 0x2: // and
+            v[x] = C8G_BLEND(m8, v[x] & v[y], v[x]);
+            return true;
+        case 0x3: // xor
+            v[x] = C8G_BLEND(m8, v[x] ^ v[y], v[x]);
+            return true;
+        case 0x4: // add
+            v[15] = C8G_BLEND(m8, (c8g_u8)((c8g_u8)(v[x] + v[y]) < v[x]) & 1, v[15]);
+            v[x]  = C8G_BLEND(m8, v[x] + v[y], v[x]);
+            return true;
+        case 0x5: // sub
+            v[15] = C8G_BLEND(m8, (c8g_u8)(v[x] >= v[y]) & 1, v[15]);
+            v[x]  = C8G_BLEND(m8, v[x] - v[y], v[x]);
+            return true;
+        case 0x6: // shr
+            v[15] = C8G_BLEND(m8, v[x] & 1, v[15]);
+            v[x]  = C8G_BLEND(m8, v[x] >> 1, v[x]);
+            return true;
+        case 0x7: // subn
+            v[15] = C8G_BLEND(m8, (c8g_u8)(v[y] > v[x]) & 1, v[15]);
+            v[x]  = C8G_BLEND(m8, v[y] - v[x], v[x]);
+            return true;
+        case 0xe: // shl
+            v[15] = C8G_BLEND(m8, v[x] >> 7, v[15]);
+            v[x]  = C8G_BLEND(m8, v[x] << 1, v[x]);
+            return true;
+        }
+        return false;
+    case 0xa: // ld i, nnn
+        group->i = C8G_BLEND(m16, (c8g_u16){} + nnn, group->i);
+        return true;
+    case 0xf:
+        switch (kk)
+        {
+        case 0x07: // ld vx, dt
+            v[x] = C8G_BLEND(m8, group->dt, v[x]);
+            return true;
+        case 0x15: // ld dt, vx
+            group->dt = C8G_BLEND(m8, v[x], group->dt);
+            return true;
+        case 0x18: // ld st, vx
+            group->st = C8G_BLEND(m8, v[x], group->st);
+            return true;
+        case 0x1e: // add i, vx
+            group->i = C8G_BLEND(m16, group->i + C8G_WIDEN(v[x]), group->i);
+            return true;
+        case 0x29: // ld f, vx
+            group->i = C8G_BLEND(m16, CHIP8_FONT_ADDR + C8G_WIDEN(v[x]) * 5, group->i);
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+
+    // skips
+    group->pc += C8G_WIDEN(taken & one) * 2;
+    return true;
+}
+
+/* true if lane n sees instr at pc */
+static inline bool c8g_same_code(const chip8_group_t *group, unsigned n, uint16_t pc, uint16_t instr)
+{
+    const uint8_t *ram = group->vms[n]->ram;
+
+    return group->ram_same || (ram[pc] << 8 | ram[(pc + 1) & 0xfff]) == instr;
+}
+
+static inline bool c8g_equal(const c8g_u16 *a, const c8g_u16 *b)
+{
+    const c8g_u16 diff = *a ^ *b;
+    uint64_t words[sizeof(diff) / 8], any = 0;
+
+    memcpy(words, &diff, sizeof(diff));
+
+    for (unsigned n = 0; n < sizeof(diff) / 8; ++n)
+        any |= words[n];
+
+    return !any;
+}
+
+static void c8g_set_live(chip8_group_t *group)
+{
+    for (unsigned n = 0; n < C8G_LANES; ++n)
+    {
+        group->live[n]  = (group->in >> n) & 1 ? 0xffff : 0;
+        group->live8[n] = (group->in >> n) & 1 ? 0xff : 0;
+    }
+}
+
+/* returns the head of a loop that may be idle if the lanes just closed one, 0xffff otherwise */
+static uint16_t c8g_step(chip8_group_t *group)
+{
+    const chip8_t *lead;
+    uint16_t pc, instr;
+    unsigned first;
+    bool     changed = false, vector;
+
+    // ram written by the lanes stepped on their own
+    uint16_t store_at[C8G_LANES];
+    uint8_t  store_size[C8G_LANES];
+    unsigned nstores = 0;
+
+    group->pc &= 0xfff;
+
+    // the first lane in the vectors leads, lane 0 if they are all out
+    first = group->in ? __builtin_ctz(group->in) : 0;
+    lead  = group->vms[first];
+    pc    = group->in ? group->pc[first] : lead->pc & 0xfff;
+    instr = lead->ram[pc] << 8 | lead->ram[(pc + 1) & 0xfff];
+
+    // lanes at another pc or seeing other code there leave the vectors...
+    if (group->in)
+    {
+        const c8g_u16 m16 = (c8g_u16)(group->pc == pc) & group->live;
+
+        if (!c8g_equal(&m16, &group->live) || !group->ram_same)
+        {
+            for (uint32_t lanes = group->in; lanes; lanes &= lanes - 1)
+            {
+                const unsigned n = __builtin_ctz(lanes);
+
+                if (!m16[n] || !c8g_same_code(group, n, pc, instr))
+                {
+                    c8g_store_lane(group, n);
+                    group->in &= ~(1u << n);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // ...and the ones that caught up join them again
+    for (uint32_t lanes = group->all & ~group->in; lanes; lanes &= lanes - 1)
+    {
+        const unsigned n = __builtin_ctz(lanes);
+
+        if ((group->vms[n]->pc & 0xfff) == pc && c8g_same_code(group, n, pc, instr))
+        {
+            c8g_load_lane(group, n);
+            group->in |= 1u << n;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        c8g_set_live(group);
+
+    group->pc = C8G_BLEND(group->live, group->pc + 2, group->pc);
+    vector    = c8g_exec(group, instr);
+
+    if (!vector)
+        group->pc = C8G_BLEND(group->live, group->pc - 2, group->pc);
+
+    // lanes out of the vectors live in their chip8_t
+    for (uint32_t lanes = vector ? group->all & ~group->in : group->all; lanes; lanes &= lanes - 1)
+    {
+        const unsigned n  = __builtin_ctz(lanes);
+        const bool     in = (group->in >> n) & 1;
+        chip8_t       *c8 = group->vms[n];
+
+        if (in)
+            c8g_store_lane(group, n);
+
+        if ((store_size[nstores] = c8g_stores(c8->ram[c8->pc & 0xfff] << 8 | c8->ram[(c8->pc + 1) & 0xfff])))
+            store_at[nstores++] = c8->i;
+
+        c8->cycles = 1;
+        c8_naive_step(c8);
+
+        if (in)
+            c8g_load_lane(group, n);
+    }
+
+    for (unsigned k = 0; k < nstores && group->ram_same; ++k)
+        group->ram_same = c8g_ram_same_at(group, store_at[k], store_size[k]);
+
+    ++group->run_time;
+
+    if (group->in != group->all)
+        return 0xffff;
+
+    if ((instr >> 12) == 0x1 && (instr & 0xfff) != group->idle_miss && c8_idle_candidate(lead->ram, instr & 0xfff, pc))
+        return instr & 0xfff;
+
+    if ((instr & 0xf0ff) == 0xf00a && pc != group->idle_miss)
+        return pc;
+
+    return 0xffff;
+}
+
+/*
+ * c8_idle_skip for the whole group, which only skips if every lane would skip
+ * the same number of cycles so they stay in lockstep. Returns the cycles
+ * skipped, out of budget.
+ */
+static unsigned c8g_idle_skip(chip8_group_t *group, uint16_t head, unsigned budget)
+{
+    chip8_t  sim[C8G_LANES];
+    unsigned left = budget;
+
+    for (unsigned n = 0; n < group->count; ++n)
+    {
+        c8g_store_lane(group, n);
+
+        sim[n]        = *group->vms[n];
+        sim[n].cycles = budget;
+        c8_idle_skip(&sim[n], 0);
+
+        if (n && sim[n].cycles != left)
+        {
+            group->idle_miss = head;
+            return 0;
+        }
+
+        left = sim[n].cycles;
+    }
+
+    if (left == budget)
+        return 0;
+
+    for (unsigned n = 0; n < group->count; ++n)
+    {
+        chip8_t *c8 = group->vms[n];
+
+        memcpy(c8->v, sim[n].v, sizeof(c8->v));
+        c8->i        = sim[n].i;
+        c8->state    = sim[n].state;
+        c8->run_time = sim[n].run_time;
+
+        c8g_load_lane(group, n);
+    }
+
+    group->run_time += budget - left;
+    return budget - left;
+}
+
+/* returns NULL if count is 0 or more than CHIP8_GROUP_LANES */
+chip8_group_t *c8_group_new(chip8_t **vms, unsigned count)
+{
+    chip8_group_t *group;
+
+    if (!count || count > C8G_LANES)
+        return NULL;
+
+    group = (chip8_group_t*)calloc(1, sizeof(*group));
+
+    if (!group)
+    {
+        fprintf(stderr, "group: out of memory\n");
+        exit(1);
+    }
+
+    group->count = count;
+
+    for (unsigned n = 0; n < count; ++n)
+        group->vms[n] = vms[n];
+
+    group->all = count == 32 ? ~0u : (1u << count) - 1;
+
+    return group;
+}
+
+void c8_group_free(chip8_group_t *group)
+{
+    free(group);
+}
+
+void c8_group_run(chip8_group_t *group, unsigned cycles)
+{
+    unsigned end;
+
+    if (cycles == 0)
+        cycles = CHIP8_TICK;
+
+    // lanes must agree on time for the timers to tick together
+    for (unsigned n = 1; n < group->count; ++n)
+    {
+        if (group->vms[n]->run_time  != group->vms[0]->run_time ||
+            group->vms[n]->next_tick != group->vms[0]->next_tick)
+        {
+            for (unsigned k = 0; k < group->count; ++k)
+                c8_run(group->vms[k], cycles);
+            return;
+        }
+    }
+
+    for (unsigned n = 0; n < group->count; ++n)
+    {
+        c8_input_sync(group->vms[n]);
+        c8g_load_lane(group, n);
+    }
+
+    group->in = group->all;
+    c8g_set_live(group);
+
+    group->run_time = group->vms[0]->run_time;
+    group->ram_same  = c8g_ram_same(group);
+    group->idle_miss = 0xffff;
+
+    end = group->run_time + cycles;
+
+    // same as c8_run, every lane is in its chip8_t between the slices
+    while ((int)(group->run_time - end) < 0)
+    {
+        unsigned budget = end - group->run_time;
+
+        for (unsigned n = 0; n < group->count; ++n)
+        {
+            const unsigned lane = c8_sched_budget(group->vms[n], end);
+
+            if (budget > lane)
+                budget = lane;
+        }
+
+        while (budget)
+        {
+            const uint16_t head = c8g_step(group);
+
+            if (--budget && head != 0xffff)
+                budget -= c8g_idle_skip(group, head, budget);
+        }
+
+        for (uint32_t lanes = group->in; lanes; lanes &= lanes - 1)
+            c8g_store_lane(group, __builtin_ctz(lanes));
+
+        for (unsigned n = 0; n < group->count; ++n)
+            c8_sched_events(group->vms[n]);
+
+        group->idle_miss = 0xffff;
+
+        for (uint32_t lanes = group->in; lanes; lanes &= lanes - 1)
+            c8g_load_lane(group, __builtin_ctz(lanes));
+    }
+
+    for (uint32_t lanes = group->in; lanes; lanes &= lanes - 1)
+        c8g_store_lane(group, __builtin_ctz(lanes));
+}
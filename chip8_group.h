@@ -0,0 +1,23 @@
+#ifndef CHIP8_GROUP_H
+#define CHIP8_GROUP_H
+
+#include "chip8.h"
+
+/* instances per group, one per vector lane: 8, 16 or 32 */
+#ifndef CHIP8_GROUP_LANES
+#define CHIP8_GROUP_LANES 16
+#endif
+
+/*
+ * Runs up to CHIP8_GROUP_LANES instances in lockstep, executing each
+ * instruction once for all the lanes sitting at the same pc. Meant for many
+ * copies of one ROM fed different inputs. The instances are not owned by the
+ * group, they are up to date whenever c8_group_run returns.
+ */
+typedef struct chip8_group chip8_group_t;
+
+chip8_group_t *c8_group_new(chip8_t **vms, unsigned count);
+void           c8_group_free(chip8_group_t *group);
+void           c8_group_run(chip8_group_t *group, unsigned cycles);
+
+#endif // CHIP8_GROUP_H
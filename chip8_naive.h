@@ -1,8 +1,14 @@
 #include "chip8_private.h"
 
+static void c8_idle_skip(chip8_t *c8, unsigned pending);
+
 static void c8_naive_step(chip8_t *c8)
 {
-    const uint16_t instr = c8->ram[c8->pc] << 8 | c8->ram[c8->pc + 1];
+    bool idle = false;
+
+    c8->pc &= 0xfff;
+
+    const uint16_t instr = c8->ram[c8->pc] << 8 | c8->ram[(c8->pc + 1) & 0xfff];
     c8->pc += 2;
 
     const uint8_t x    = (instr >> 8) & 0x0f;
@@ -19,7 +25,7 @@ static void c8_naive_step(chip8_t *c8)
         switch (nnn)
         {
         case 0x00e0: // cls
-            memset(c8->vram, 0, CHIP8_VIDEO_ROWS * CHIP8_VIDEO_COLS);
+            c8_clear(c8);
             break;
         case 0x00ee: // ret
             c8_pop(c8);
@@ -30,6 +36,7 @@ static void c8_naive_step(chip8_t *c8)
         }
         break;
     case 0x1: // jp nnn
+        idle = c8_idle_candidate(c8->ram, nnn, (c8->pc - 2) & 0xfff);
         c8_jump(c8, nnn);
         break;
     case 0x2: // call nnn
@@ -108,7 +115,7 @@ static void c8_naive_step(chip8_t *c8)
         c8_jump(c8, nnn + c8->v[0]);
         break;
     case 0xc: // rnd vx, byte
-        *vx = rand() & kk;
+        *vx = c8_rand(c8) & kk;
         break;
     case 0xd: // drw vx, vy, nibble
         c8_draw(c8, *vx, *vy, instr & 0xf);
@@ -117,12 +124,14 @@ static void c8_naive_step(chip8_t *c8)
         switch (instr & 0xff)
         {
         case 0x9e: // skp vx
-            if (c8->kbd[*vx])
+            if (c8->kbd[*vx & 0xf])
                 c8->pc += 2;
+            c8_input_sync(c8);
             break;
         case 0xa1: // sknp vx
-            if (!c8->kbd[*vx])
+            if (!c8->kbd[*vx & 0xf])
                 c8->pc += 2;
+            c8_input_sync(c8);
             break;
         default:
             c8->state |= CHIP8_STATE_ILEGAL;
@@ -135,7 +144,8 @@ static void c8_naive_step(chip8_t *c8)
             *vx = c8->dt;
             break;
         case 0x0a: // ld vx, key
-            *vx = c8_wait_key(c8);
+            *vx  = c8_wait_key(c8);
+            idle = *vx == 255;
             break;
         case 0x15: // ld dt, vx
             c8->dt = *vx;
@@ -144,8 +154,7 @@ static void c8_naive_step(chip8_t *c8)
             c8->st = *vx;
             break;
         case 0x1e: // add i, vx
-            c8->v[15] = (c8->i + *vx) > 255; // XXX: undocumented
-            c8->i  = c8->i + *vx;
+            c8->i = c8->i + *vx;
             break;
         case 0x29: // ld f, vx
             c8->i = CHIP8_FONT_ADDR + *vx * 5;
@@ -171,14 +180,64 @@ static void c8_naive_step(chip8_t *c8)
     c8->run_time++;
     c8->cycles--;
 
-    if ((c8->run_time % (CHIP8_CLOCK/60)) == 0)
+    if (idle)
+        c8_idle_skip(c8, 0);
+}
+
+/*
+ * Skips the passes of an idle loop starting at pc that fit in cycles, less
+ * the pending ones the caller has yet to count. One pass is run on a copy
+ * to let the registers settle and a second one must leave them as they are,
+ * the loop then does the same until a deadline changes dt or the keys.
+ */
+static void c8_idle_skip(chip8_t *c8, unsigned pending)
+{
+    const uint16_t head = c8->pc & 0xfff;
+    chip8_t        pass[2];
+    unsigned       len[2];
+
+    if (c8->cycles <= pending || head == c8->idle_miss || c8->keyq_head != c8->keyq_tail)
+        return;
+
+    for (unsigned p = 0; p < 2; ++p)
     {
-        if (c8->dt)
-            c8->dt--;
+        chip8_t *sim = &pass[p];
+
+        *sim   = p ? pass[0] : *c8;
+        len[p] = 0;
+
+        do
+        {
+            const uint16_t pc = sim->pc & 0xfff;
+
+            if (len[p]++ == CHIP8_IDLE_SPAN || !c8_idle_instr(sim->ram[pc] << 8 | sim->ram[(pc + 1) & 0xfff]))
+                return;
+
+            // with no cycles left the step won't look for idle loops itself
+            sim->cycles = 1;
+            c8_naive_step(sim);
+        }
+        while ((sim->pc & 0xfff) != head);
+    }
 
-        if (c8->st)
-            c8->st--;
+    if (memcmp(pass[0].v, pass[1].v, sizeof(pass[0].v)) || pass[0].i != pass[1].i || pass[0].state != pass[1].state)
+    {
+        c8->idle_miss = head;
+        return;
     }
 
-    c8->poll(c8->kbd, c8->poll_data);
+    if (c8->cycles - pending < len[0] + len[1])
+        return;
+
+    memcpy(c8->v, pass[0].v, sizeof(c8->v));
+    c8->i     = pass[0].i;
+    c8->state = pass[0].state;
+
+    c8->run_time += len[0];
+    c8->cycles   -= len[0];
+
+    const unsigned skip = (c8->cycles - pending) / len[1] * len[1];
+
+    c8->run_time += skip;
+    c8->cycles   -= skip;
 }
@@ -55,6 +55,11 @@ enum {
     CHIP8_LAST_REG = CHIP8_DT
 };
 
+#define CHIP8_REG_BIT(r) (1u << (r))
+
+/* queued key events are the key number with this bit set for presses */
+#define CHIP8_KEY_DOWN 0x10
+
 static inline void c8_push(chip8_t *c8)
 {
     if (c8->stack_ptr == CHIP8_STACK_SIZE)
@@ -90,34 +95,112 @@ static inline void c8_jump(chip8_t *c8, uint16_t addr)
     c8->pc = addr;
 }
 
+/* sprites are clipped at the right and bottom edges, vf is set on any collision */
 static inline void c8_draw(chip8_t *c8, uint8_t x, uint8_t y, uint8_t nrows)
 {
+    bool collision = false;
+
     x &= 0x3f;
     y &= 0x1f;
 
-    for (unsigned row = 0; row < nrows; ++row)
+    for (unsigned row = 0; row < nrows && y + row < CHIP8_VIDEO_ROWS; ++row)
     {
-        uint8_t  src = c8->ram[c8->i+row];
-        for (unsigned col = 0; col < 8; ++col)
-        {
-            if (src & 0x80)
-            {
-                if (x + col >= CHIP8_VIDEO_COLS || y + row >= CHIP8_VIDEO_ROWS)
-                    continue;
-                uint8_t *dst = &c8->vram[(y + row) * CHIP8_VIDEO_COLS + (x+col)];
+        const chip8_row_t spr = (chip8_row_t)c8->ram[(c8->i+row) & 0xfff] << (CHIP8_VIDEO_COLS - 8) >> x;
+        chip8_row_t      *dst = &c8->vram[y + row];
 
-                *dst ^= 1;
-                c8->v[15] = !*dst;
-            }
+        if (spr)
+            c8->damage |= 1u << (y + row);
 
-            src <<= 1;
-        }
+        collision |= (*dst & spr) != 0;
+        *dst ^= spr;
     }
+
+    c8->v[15] = collision;
 }
 
 static inline void c8_clear(chip8_t *c8)
 {
-    memset(c8->vram, 0, CHIP8_VIDEO_ROWS*CHIP8_VIDEO_COLS);
+    for (unsigned row = 0; row < CHIP8_VIDEO_ROWS; ++row)
+    {
+        if (c8->vram[row])
+            c8->damage |= 1u << row;
+
+        c8->vram[row] = 0;
+    }
+}
+
+/*
+ * Applies the queued key events to kbd. A release of a key pressed earlier in
+ * the same batch is left for the next sync, so short taps are still seen.
+ * Key instructions sync after reading kbd for the same reason.
+ */
+static inline void c8_input_sync(chip8_t *c8)
+{
+    uint16_t pressed = 0;
+
+    while (c8->keyq_head != c8->keyq_tail)
+    {
+        const uint8_t event = c8->keyq[c8->keyq_head % CHIP8_KEY_QUEUE];
+        const uint8_t key   = event & 0xf;
+        const bool    down  = event & CHIP8_KEY_DOWN;
+
+        if (!down && (pressed >> key & 1))
+            break;
+
+        pressed    |= down << key;
+        c8->kbd[key] = down;
+        c8->keyq_head++;
+    }
+}
+
+/* deadlines are absolute run_time values and may wrap around */
+static inline bool c8_reached(const chip8_t *c8, unsigned deadline)
+{
+    return (int)(c8->run_time - deadline) >= 0;
+}
+
+/* cycles from now to the nearest deadline, end being the one of the caller */
+static inline unsigned c8_sched_budget(const chip8_t *c8, unsigned end)
+{
+    unsigned budget = end - c8->run_time;
+
+    if (budget > c8->next_tick - c8->run_time)
+        budget = c8->next_tick - c8->run_time;
+
+    if (c8->input_interval && budget > c8->next_input - c8->run_time)
+        budget = c8->next_input - c8->run_time;
+
+    return budget;
+}
+
+/* runs what is due, backends stop right at the nearest deadline */
+static inline void c8_sched_events(chip8_t *c8)
+{
+    bool sync = false;
+
+    while (c8_reached(c8, c8->next_tick))
+    {
+        if (c8->dt)
+            c8->dt--;
+
+        if (c8->st)
+            c8->st--;
+
+        c8->next_tick += CHIP8_TICK;
+        sync = true;
+    }
+
+    if (c8->input_interval && c8_reached(c8, c8->next_input))
+    {
+        c8->next_input = c8->run_time + c8->input_interval;
+        sync = true;
+    }
+
+    if (sync)
+        c8_input_sync(c8);
+
+    // loops that were busy may be waiting now
+    c8->idle_miss = 0xffff;
 }
 
 static inline uint8_t c8_wait_key(chip8_t *c8)
@@ -134,11 +217,62 @@ static inline uint8_t c8_wait_key(chip8_t *c8)
     }
 
     if (result == 255)
+    {
+        c8_input_sync(c8);
         c8->pc -= 2;
+    }
 
     return result;
 }
 
+/* xorshift32, the top byte is the least correlated with the last result */
+static inline uint8_t c8_rand(chip8_t *c8)
+{
+    uint32_t x = c8->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    c8->rng = x;
+    return x >> 24;
+}
+
+/*
+ * The code bitmap only covers the translations of the running backend. Stores
+ * check it and only invalidate when they hit code, invalidating clears the
+ * bits of the range since every translation depending on it is dropped.
+ */
+static inline bool c8_code_hit(const chip8_t *c8, uint16_t addr, unsigned len)
+{
+    for (; len; --len, ++addr)
+    {
+        addr &= 0xfff;
+        if (c8->code[addr >> 5] >> (addr & 31) & 1)
+            return true;
+    }
+
+    return false;
+}
+
+static inline void c8_code_mark(chip8_t *c8, uint16_t addr, unsigned len)
+{
+    for (; len; --len, ++addr)
+    {
+        addr &= 0xfff;
+        c8->code[addr >> 5] |= 1u << (addr & 31);
+    }
+}
+
+static inline void c8_code_clear(chip8_t *c8, uint16_t addr, unsigned len)
+{
+    for (; len; --len, ++addr)
+    {
+        addr &= 0xfff;
+        c8->code[addr >> 5] &= ~(1u << (addr & 31));
+    }
+}
+
 static inline void c8_load_bcd(chip8_t *c8, uint8_t val)
 {
     c8->ram[(c8->i+0) & 0xfff] = val / 100;
@@ -148,14 +282,215 @@ static inline void c8_load_bcd(chip8_t *c8, uint8_t val)
 
 static inline void c8_load_ram(chip8_t *c8, bool from_ram, uint8_t x)
 {
-    if (from_ram)
-        memcpy(c8->v, &c8->ram[c8->i], x+1);
-    else
-        memcpy(&c8->ram[c8->i], c8->v, x+1);
+    for (unsigned n = 0; n <= x; ++n)
+    {
+        if (from_ram)
+            c8->v[n] = c8->ram[(c8->i+n) & 0xfff];
+        else
+            c8->ram[(c8->i+n) & 0xfff] = c8->v[n];
+    }
 
     c8->i = c8->i+x+1;
 }
 
+/*
+ * Registers read and written by an instruction, as CHIP8_REG_BIT masks.
+ * Returns true if the instruction may change control flow or memory, which
+ * is where translators stop looking ahead.
+ */
+static inline bool c8_scan(uint16_t instr, uint32_t *reads, uint32_t *writes)
+{
+    const uint32_t vx = CHIP8_REG_BIT((instr >> 8) & 0xf);
+    const uint32_t vy = CHIP8_REG_BIT((instr >> 4) & 0xf);
+    const uint32_t vf = CHIP8_REG_BIT(CHIP8_VF);
+    const uint32_t i  = CHIP8_REG_BIT(CHIP8_I);
+
+    *reads = *writes = 0;
+
+    switch (instr >> 12)
+    {
+    case 0x0: // cls, ret, sys addr
+        return instr != 0x00e0;
+    case 0x1: // jp nnn
+    case 0x2: // call nnn
+        return true;
+    case 0x3: // se vx, kk
+    case 0x4: // sne vx, kk
+        *reads = vx;
+        return true;
+    case 0x5: // se vx, vy
+    case 0x9: // sne vx, vy
+        *reads = vx | vy;
+        return true;
+    case 0x6: // ld vx, kk
+        *writes = vx;
+        return false;
+    case 0x7: // add vx, kk
+        *reads = *writes = vx;
+        return false;
+    case 0x8: // op vx, vy
+        switch (instr & 0xf)
+        {
+        case 0x0: // ld
+            *reads  = vy;
+            *writes = vx;
+            return false;
+        case 0x1: // or
+        case 0x2: // and
+        case 0x3: // xor
+            *reads  = vx | vy;
+            *writes = vx;
+            return false;
+        case 0x4: // add
+        case 0x5: // sub
+        case 0x7: // subn
+            *reads  = vx | vy;
+            *writes = vx | vf;
+            return false;
+        case 0x6: // shr
+        case 0xe: // shl
+            *reads  = vx;
+            *writes = vx | vf;
+            return false;
+        }
+        return true;
+    case 0xa: // ld i, nnn
+        *writes = i;
+        return false;
+    case 0xb: // jp v0, addr
+        *reads = CHIP8_REG_BIT(CHIP8_V0);
+        return true;
+    case 0xc: // rnd vx, byte
+        *writes = vx;
+        return false;
+    case 0xd: // drw vx, vy, nibble
+        *reads  = vx | vy | i;
+        *writes = vf;
+        return true;
+    case 0xe: // skp vx, sknp vx
+        *reads = vx;
+        return true;
+    case 0xf:
+        switch (instr & 0xff)
+        {
+        case 0x07: // ld vx, dt
+            *writes = vx;
+            return false;
+        case 0x0a: // ld vx, key
+            *writes = vx;
+            return true;
+        case 0x15: // ld dt, vx
+        case 0x18: // ld st, vx
+            *reads = vx;
+            return false;
+        case 0x1e: // add i, vx
+            *reads  = vx | i;
+            *writes = i;
+            return false;
+        case 0x29: // ld f, vx
+            *reads  = vx;
+            *writes = i;
+            return false;
+        case 0x33: // ld b, vx
+            *reads = vx | i;
+            return true;
+        case 0x55: // ld [i], vx
+            *reads  = (vx << 1) - 1;
+            *reads |= *writes = i;
+            return true;
+        case 0x65: // ld vx, [i]
+            *reads  = i;
+            *writes = ((vx << 1) - 1) | i;
+            return false;
+        }
+        return true;
+    }
+
+    return true;
+}
+
+#define CHIP8_IDLE_SPAN 8 /* longest idle loop looked for, in instructions */
+
+/* 0 for instructions with effects beyond the registers, 2 for those reading dt or the keys, 1 for the rest */
+static inline int c8_idle_instr(uint16_t instr)
+{
+    switch (instr >> 12)
+    {
+    case 0x1: // jp nnn
+    case 0x3: // se vx, kk
+    case 0x4: // sne vx, kk
+    case 0x6: // ld vx, kk
+    case 0x7: // add vx, kk
+    case 0xa: // ld i, nnn
+        return 1;
+    case 0x5: // se vx, vy
+    case 0x9: // sne vx, vy
+        return (instr & 0xf) == 0;
+    case 0x8: // op vx, vy
+        return (instr & 0xf) <= 0x7 || (instr & 0xf) == 0xe;
+    case 0xe: // skp vx, sknp vx
+        return ((instr & 0xff) == 0x9e || (instr & 0xff) == 0xa1) ? 2 : 0;
+    case 0xf:
+        switch (instr & 0xff)
+        {
+        case 0x07: // ld vx, dt
+        case 0x0a: // ld vx, key
+            return 2;
+        case 0x29: // ld f, vx
+            return 1;
+        }
+        return 0;
+    }
+
+    return 0;
+}
+
+/*
+ * True if the loop from head back to the jp at jump only changes registers and
+ * polls dt or the keys, or if it is a jp to itself. Only a hint, c8_idle_skip
+ * checks what the loop actually does.
+ */
+static inline bool c8_idle_candidate(const uint8_t *ram, uint16_t head, uint16_t jump)
+{
+    bool polls = false;
+
+    if (head > jump || jump - head >= 2 * CHIP8_IDLE_SPAN)
+        return false;
+
+    for (uint16_t addr = head; addr < jump; addr += 2)
+    {
+        const int kind = c8_idle_instr(ram[addr] << 8 | ram[(addr + 1) & 0xfff]);
+
+        if (!kind)
+            return false;
+
+        polls |= kind == 2;
+    }
+
+    return polls || head == jump;
+}
+
+/* true if vf is overwritten before anyone reads it, looking up to window instructions from addr */
+static inline bool c8_vf_dead(const uint8_t *ram, uint16_t addr, unsigned window)
+{
+    for (unsigned n = 0; n < window && addr < 0xfff; ++n, addr += 2)
+    {
+        const uint16_t instr = ram[addr] << 8 | ram[addr + 1];
+        uint32_t reads, writes;
+        bool end = c8_scan(instr, &reads, &writes);
+
+        if (reads & CHIP8_REG_BIT(CHIP8_VF))
+            return false;
+
+        if (writes & CHIP8_REG_BIT(CHIP8_VF))
+            return true;
+
+        if (end)
+            return false;
+    }
+
+    return false;
+}
 
 #endif // CHIP8_PRIVATE_H
 
@@ -0,0 +1,79 @@
+#include "chip8_private.h"
+
+/*
+ * Runs code on the cached interpreter until the address it starts at has
+ * been interpreted C8TIER_HOT times, then translates a dyn block from there.
+ * Code that only runs a few times, like init routines and title screens,
+ * never pays for a translation.
+ *
+ * Both caches are kept up to date with every write, whichever tier made it.
+ * A block start whose blocks writes have dropped C8TIER_STRIKES times stays
+ * with the interpreter, which only invalidates the instructions written over.
+ *
+ * With c8_set_background_compile the block is compiled by the compiler thread
+ * instead, and the instance keeps interpreting until it is done. Blocks are
+ * installed between instructions, the next hot address waits its turn.
+ */
+#define C8TIER_HOT     256
+#define C8TIER_STRIKES 4
+
+/* end is not included, as for c8ci_invalidate */
+static void c8_tier_invalidate(chip8_t *c8, uint16_t begin, uint16_t end)
+{
+    // takes the interpreter's translations along
+    c8dyn_invalidate(c8, begin, end - 1);
+}
+
+static void c8_tier_step(chip8_t *c8)
+{
+    c8dyn_t *dyn = (c8dyn_t*)c8->dyn;
+
+    while (c8->cycles)
+    {
+        c8dyn_op_t fn;
+        uint16_t   pc;
+
+        if (c8dyn_job_done(dyn) && !c8dyn_finish(c8))
+        {
+            // ram changed under it, or it didn't fit in its space
+            dyn->heat[dyn->job.start] = 0;
+        }
+
+        pc = c8->pc &= 0xfff;
+        fn = c8dyn_lookup(dyn, pc);
+
+        if (!fn && dyn->heat[pc] >= C8TIER_HOT && dyn->strikes[pc] < C8TIER_STRIKES && !dyn->job.busy)
+        {
+            if (c8->background_compile)
+            {
+                if (!c8dyn_submit(c8, pc))
+                    dyn->heat[pc] = 0;
+            }
+            else if (!(fn = c8dyn_translate(c8)))
+            {
+                fprintf(stderr, "translation failed.\n");
+                exit(1);
+            }
+        }
+        else if (fn && fn == dyn->cache[pc].fn)
+            c8dyn_region_of((void*)fn)->entered = true;
+
+        const unsigned cycles = c8->cycles;
+
+        if (fn)
+            fn(c8);
+
+        // a block that doesn't fit in cycles returns without running anything
+        if (c8->cycles == cycles)
+        {
+            if (!fn && dyn->heat[pc] < C8TIER_HOT)
+                dyn->heat[pc]++;
+
+            c8ci_exec(c8);
+        }
+
+        // stores from either tier may have dropped blocks
+        if (dyn->ndead || dyn->retired)
+            c8dyn_reap(dyn);
+    }
+}
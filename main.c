@@ -5,27 +5,54 @@
 #include <signal.h>
 #include <unistd.h>
 #include <locale.h>
+#include <time.h>
+#include <errno.h>
 
 #include "chip8.h"
 
+#define FRAME_NS   (1000000000L / (CHIP8_CLOCK / CHIP8_TICK))
+#define TURBO_KEY  '\t'
+#define MAX_BEHIND 4 /* frames the pacing may fall behind before it gives up catching up */
+
 static chip8_t *c8 = NULL;
 
-#if 1
-void kbd_poll(uint8_t kbd[16], uintptr_t data)
+/* emulated frames per displayed frame while in turbo */
+static unsigned turbo_frames = 8;
+static bool     turbo        = false;
+
+/* terminals only report presses, so a key is held down until the next frame */
+void kbd_poll(void)
 {
-    memset(kbd, 0, 16);
-    int rk = getch();
+    static uint16_t held = 0;
+    int rk;
 
-    if (rk != ERR)
+    for (int key = 0; key < 16; ++key)
     {
+        if (held & (1u << key))
+            c8_key_event(c8, key, false);
+    }
+
+    held = 0;
+
+    while ((rk = getch()) != ERR)
+    {
+        if (rk == TURBO_KEY)
+        {
+            turbo = !turbo;
+            continue;
+        }
+
         if (rk >= '0' && rk <= '9')
             rk -= '0';
         else if (rk >= 'a' && rk <= 'f')
             rk = (rk - 'a') + 10;
         else if (rk >= 'A' && rk <= 'F')
             rk = (rk - 'A') + 10;
+        else
+            continue;
 
-        kbd[rk] = 1;
+        if (c8_key_event(c8, rk, true))
+            held |= 1u << rk;
     }
 }
 
@@ -41,16 +68,263 @@ void quit()
 
 #define swap16 __builtin_bswap16
 
+static int64_t ns_since(const struct timespec *t)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000000000LL + (now.tv_nsec - t->tv_nsec);
+}
+
+/*
+ * Moves the deadline a frame ahead and sleeps until it. The deadline is
+ * absolute, so time spent emulating and drawing doesn't add up to drift.
+ */
+static void pace(struct timespec *next)
+{
+    next->tv_nsec += FRAME_NS;
+    if (next->tv_nsec >= 1000000000L)
+    {
+        next->tv_nsec -= 1000000000L;
+        next->tv_sec++;
+    }
+
+    // after a stall, start over instead of rushing through the missed frames
+    if (ns_since(next) > MAX_BEHIND * FRAME_NS)
+    {
+        clock_gettime(CLOCK_MONOTONIC, next);
+        return;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR)
+        ;
+}
+
+static int parse_backend(const char *name)
+{
+    if (!strcmp(name, "naive"))
+        return CHIP8_BACKEND_NAIVE;
+    if (!strcmp(name, "ci"))
+        return CHIP8_BACKEND_CI;
+    if (!strcmp(name, "dyn"))
+        return CHIP8_BACKEND_DYN;
+    if (!strcmp(name, "tier"))
+        return CHIP8_BACKEND_TIERED;
+
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b naive|ci|dyn|tier] [-c kb] [-s seed] [-t frames] [-n frames [-i script]] rom\n", prog);
+    fprintf(stderr, "  -b  tier interprets cold code and compiles hot code, on a background thread when interactive\n");
+    fprintf(stderr, "  -c  executable memory for translated code, in 64 KB steps\n");
+    fprintf(stderr, "  -t  start in turbo, running this many frames per displayed one; tab toggles it\n");
+    exit(1);
+}
+
+typedef struct {
+    unsigned frame;
+    uint8_t  key;
+    bool     pressed;
+} input_t;
+
+/*
+ * One event per line: the frame it is queued before, the key in hex and
+ * "down" or "up". Blank lines and lines starting with # are skipped.
+ */
+static input_t *load_script(const char *path, size_t *count)
+{
+    input_t *events = NULL;
+    size_t   size   = 0;
+    unsigned line   = 0;
+    char     buf[128];
+    FILE    *fp;
+
+    if (!(fp = fopen(path, "r")))
+    {
+        perror(path);
+        exit(1);
+    }
+
+    *count = 0;
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+        unsigned frame, key;
+        char     state[8];
+
+        ++line;
+
+        if (buf[strspn(buf, " \t\r\n")] == '\0' || buf[strspn(buf, " \t")] == '#')
+            continue;
+
+        if (sscanf(buf, "%u %x %7s", &frame, &key, state) != 3 || key > 0xf ||
+            (strcmp(state, "down") && strcmp(state, "up")))
+        {
+            fprintf(stderr, "%s:%u: expected <frame> <key> down|up\n", path, line);
+            exit(1);
+        }
+
+        if (*count && frame < events[*count - 1].frame)
+        {
+            fprintf(stderr, "%s:%u: frames must not go back\n", path, line);
+            exit(1);
+        }
+
+        if (*count == size)
+        {
+            size   = size ? size * 2 : 64;
+            events = (input_t*)realloc(events, size * sizeof(input_t));
+
+            if (!events)
+            {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        events[(*count)++] = (input_t){ frame, key, !strcmp(state, "down") };
+    }
+
+    fclose(fp);
+    return events;
+}
+
+static uint64_t state_hash(const chip8_t *c8)
+{
+    const size_t size = c8_save_state(c8, NULL, 0);
+    uint8_t     *buf  = (uint8_t*)malloc(size);
+    uint64_t     hash = 0xcbf29ce484222325ull;
+
+    c8_save_state(c8, buf, size);
+
+    // fnv-1a
+    for (size_t n = 0; n < size; ++n)
+        hash = (hash ^ buf[n]) * 0x100000001b3ull;
+
+    free(buf);
+    return hash;
+}
+
+/* runs as fast as possible without a terminal, for regression and throughput jobs */
+static int run_headless(unsigned frames, const char *script)
+{
+    input_t        *events = NULL;
+    size_t          count  = 0, next = 0;
+    unsigned        start_time = c8->run_time;
+    struct timespec begin, end;
+    double          secs;
+    chip8_code_stats_t stats;
+
+    if (script)
+        events = load_script(script, &count);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (unsigned frame = 0; frame < frames; ++frame)
+    {
+        for (; next < count && events[next].frame == frame; ++next)
+        {
+            if (!c8_key_event(c8, events[next].key, events[next].pressed))
+            {
+                fprintf(stderr, "%s: key queue full at frame %u\n", script, frame);
+                return 1;
+            }
+        }
+
+        c8_run(c8, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    printf("hash %016llx\n", (unsigned long long)state_hash(c8));
+    printf("frames %u cycles %u state %08x\n", frames, c8->run_time - start_time, c8->state);
+    printf("time %.6f s, %.1f frames/s, %.2fx real time\n",
+           secs, frames / secs, frames / secs / 60);
+
+    if (c8->backend == CHIP8_BACKEND_DYN || c8->backend == CHIP8_BACKEND_TIERED)
+    {
+        c8_code_stats(c8, &stats);
+        printf("code %zu bytes, %u blocks, %u translations, %u retranslations, %u evictions\n",
+               stats.code_bytes, stats.blocks, stats.translations, stats.retranslations, stats.evictions);
+    }
+
+    free(events);
+    c8_free(c8);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     uint8_t data[CHIP8_RAM_SIZE];
     size_t size;
-    c8 = c8_new();
+    int backend = CHIP8_BACKEND_DYN;
+    unsigned frames = 0;
+    uint32_t seed = 0;
+    size_t budget = 0;
+    const char *script = NULL;
+    struct timespec next;
+    int opt;
+    FILE *fp;
+
+    while ((opt = getopt(argc, argv, "b:c:s:t:n:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            if ((backend = parse_backend(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            if (!(budget = strtoul(optarg, NULL, 0) * 1024))
+                usage(argv[0]);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            if (!(frames = strtoul(optarg, NULL, 0)))
+                usage(argv[0]);
+            break;
+        case 'i':
+            script = optarg;
+            break;
+        case 't':
+            if (!(turbo_frames = strtoul(optarg, NULL, 0)))
+                usage(argv[0]);
+            turbo = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc || (script && !frames))
+        usage(argv[0]);
+
+    if (!(fp = fopen(argv[optind], "rb")))
+    {
+        perror(argv[optind]);
+        return 1;
+    }
 
-    size = fread(data, 1, sizeof(data), fopen(argv[1], "rb"));
+    size = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
 
+    c8 = c8_new();
+    c8_seed(c8, seed);
     c8_load(c8, data, size);
-    c8_set_poll(c8, kbd_poll, 0);
+    c8_set_backend(c8, backend);
+    c8_set_code_budget(c8, budget);
+
+    if (frames)
+        return run_headless(frames, script);
+
+    // translations must not hold up a frame, batch runs stay reproducible. On
+    // a single cpu the compiler thread would only take turns with this one
+    c8_set_background_compile(c8, sysconf(_SC_NPROCESSORS_ONLN) > 1);
 
     atexit(quit);
     signal(SIGINT, (__sighandler_t)quit);
@@ -62,22 +336,34 @@ int main(int argc, char *argv[])
     keypad(NULL, true);
     timeout(0);
 
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
     while (1)
     {
+        unsigned stop = CHIP8_RUN_CYCLES;
+
         move(CHIP8_VIDEO_ROWS+1, 0);
-        c8_run(c8, 0);
+        kbd_poll();
+
+        // turbo runs unthrottled and only draws the last of its frames
+        for (unsigned n = turbo ? turbo_frames : 1; n && stop == CHIP8_RUN_CYCLES; --n)
+            stop = c8_run(c8, 0);
+
+        uint32_t damage = c8_take_damage(c8);
 
-        move(0, 0);
         for (int row = 0; row < CHIP8_VIDEO_ROWS; ++row)
         {
+            if (!(damage & (1u << row)))
+                continue;
+
+            move(row, 0);
             for (int col = 0; col < CHIP8_VIDEO_COLS; ++col)
             {
-                if (c8->vram[row * CHIP8_VIDEO_COLS + col])
+                if (c8_pixel(c8, col, row))
                     printw("#");
                 else
                     printw(" ");
             }
-            printw("\n");
         }
 
         mvprintw(0, 65, "pc:%04x = %04x", c8->pc, c8->ram[c8->pc-2]);
@@ -90,73 +376,28 @@ int main(int argc, char *argv[])
         refresh();
 
         mvprintw(16, 65, "%08x", c8->state);
+        mvprintw(17, 65, turbo ? "turbo x%-4u" : "          ", turbo_frames);
 
-        usleep(16666);
-    }
-
-    return 0;
-}
-#else
-
-void kbd_poll(uint8_t kbd[16], uintptr_t data)
-{
-    memset(kbd, 0, 16);
-    int rk = getch();
-
-    if (rk != ERR)
-    {
-        if (rk >= '0' && rk <= '9')
-            rk -= '0';
-        else if (rk >= 'a' && rk <= 'f')
-            rk = (rk - 'a') + 10;
-        else if (rk >= 'A' && rk <= 'F')
-            rk = (rk - 'A') + 10;
-
-        kbd[rk] = 1;
-    }
-}
-
-void quit()
-{
-    if (c8)
-    {
-        c8_free(c8);
-        endwin();
-        c8 = NULL;
-    }
-}
-
-#define swap16 __builtin_bswap16
-
-int main(int argc, char *argv[])
-{
-    uint8_t data[CHIP8_RAM_SIZE];
-    size_t size;
-    c8 = c8_new();
-
-    size = fread(data, 1, sizeof(data), fopen(argv[1], "rb"));
-
-    c8_load(c8, data, size);
-    c8_set_poll(c8, kbd_poll, 0);
-
-    while (!(c8->state & CHIP8_STATE_HALT))
-    {
-        c8_run(c8, 100);
+        // a stopped instance with no timers running only changes on a key press
+        if (stop != CHIP8_RUN_CYCLES && !c8_timer_cycles(c8))
+        {
+            int rk;
 
-        printf("pc:%04x = %04x\n", c8->pc, c8->ram[c8->pc-2]);
-        printf("sp:%04x = %04x\n", c8->stack_ptr, swap16(*(uint16_t*)&c8->ram[c8->stack_ptr]));
-        printf("i :%04x = %02x\n", c8->i, c8->ram[c8->i]);
-        printf("dt: %02x st: %02x\n", c8->dt, c8->st);
+            refresh();
+            timeout(-1);
+            if ((rk = getch()) != ERR)
+                ungetch(rk);
+            timeout(0);
 
-        for (int i = 0, y=4; i < 8; i++, y++)
-            printf("v%1x: %02x v%1x: %02x\n", i, c8->v[i], i+8, c8->v[i+8]);
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            continue;
+        }
 
-        usleep(16666);
-        break;
+        if (turbo)
+            clock_gettime(CLOCK_MONOTONIC, &next);
+        else
+            pace(&next);
     }
 
     return 0;
 }
-#endif
-
-
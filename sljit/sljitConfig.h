@@ -34,6 +34,14 @@
 /* Put your custom defines here. This empty section will never change
    which helps maintaining patches (with diff / patch utilities). */
 
+/* chip8: code goes to the arena of the set being translated, see chip8_dyn.h */
+#include <stddef.h>
+void *c8dyn_exec_alloc(size_t size);
+void  c8dyn_exec_free(void *ptr);
+#define SLJIT_EXECUTABLE_ALLOCATOR 0
+#define SLJIT_MALLOC_EXEC(size) c8dyn_exec_alloc(size)
+#define SLJIT_FREE_EXEC(ptr)    c8dyn_exec_free(ptr)
+
 /* --------------------------------------------------------------------- */
 /*  Architecture                                                         */
 /* --------------------------------------------------------------------- */